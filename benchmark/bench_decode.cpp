@@ -0,0 +1,245 @@
+// Decodes each file with this library and with libjpeg-turbo, reports throughput,
+// peak memory and the difference of pixels. Usage: bench_decode [-n runs] files...
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <csetjmp>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <jpeglib.h>
+
+#include "decoder.h"
+#include "stage_times.h"
+
+namespace {
+
+struct Reference {
+    size_t width = 0;
+    size_t height = 0;
+    std::vector<uint8_t> rgb;  // interleaved
+};
+
+// libjpeg errors jump back to DecodeReference, exceptions must not unwind its C frames.
+struct ReferenceError {
+    jpeg_error_mgr manager;  // first, libjpeg passes a pointer to it
+    std::jmp_buf jump;
+    char message[JMSG_LENGTH_MAX] = {};
+};
+
+// Box upsampling and CMYK inversion like this library, so the difference shows the IDCT.
+Reference DecodeReference(const std::string& data) {
+    jpeg_decompress_struct info = {};
+    ReferenceError error;
+    info.err = jpeg_std_error(&error.manager);
+    error.manager.error_exit = [](j_common_ptr common) {
+        auto error = reinterpret_cast<ReferenceError*>(common->err);
+        (*common->err->format_message)(common, error->message);
+        std::longjmp(error->jump, 1);
+    };
+
+    // declared before setjmp, so that the jump leaves no destructor behind
+    Reference result;
+    std::vector<uint8_t> row;
+    if (setjmp(error.jump)) {
+        jpeg_destroy_decompress(&info);
+        throw std::runtime_error(error.message);
+    }
+
+    jpeg_create_decompress(&info);
+    jpeg_mem_src(&info, reinterpret_cast<const unsigned char*>(data.data()), data.size());
+    jpeg_read_header(&info, TRUE);
+    bool cmyk = (info.jpeg_color_space == JCS_CMYK || info.jpeg_color_space == JCS_YCCK);
+    info.out_color_space = cmyk ? JCS_CMYK : JCS_RGB;
+    info.do_fancy_upsampling = FALSE;
+    jpeg_start_decompress(&info);
+
+    result.width = info.output_width;
+    result.height = info.output_height;
+    result.rgb.resize(result.width * result.height * 3);
+    row.resize(result.width * info.output_components);
+    while (info.output_scanline < info.output_height) {
+        uint8_t* out = result.rgb.data() + info.output_scanline * result.width * 3;
+        JSAMPROW rows[] = {row.data()};
+        jpeg_read_scanlines(&info, rows, 1);
+        for (size_t x = 0; x < result.width; ++x) {
+            const uint8_t* pixel = row.data() + x * info.output_components;
+            for (size_t c = 0; c < 3; ++c) {
+                out[x * 3 + c] = cmyk ? std::lround(pixel[c] * pixel[3] / 255.0) : pixel[c];
+            }
+        }
+    }
+    jpeg_finish_decompress(&info);
+    jpeg_destroy_decompress(&info);
+    return result;
+}
+
+Image DecodeOwn(const std::string& data) {
+    std::istringstream input(data);
+    return Decode(input);
+}
+
+std::string ReadFile(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    return {std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()};
+}
+
+// Peak resident set of this process in KiB. Unlike getrusage, it is not inherited
+// from the parent across fork and exec.
+long PeakResidentKb() {
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.starts_with("VmHWM:")) {
+            return std::atol(line.c_str() + std::strlen("VmHWM:"));
+        }
+    }
+    return 0;
+}
+
+// Peak resident memory in MiB of a fresh process decoding |path| once with |decoder|,
+// over the peak of one that only reads the file. A forked child would reuse the heap
+// the parent has already touched.
+double PeakMemory(const std::string& decoder, const std::string& path) {
+    auto run = [&](const std::string& mode) -> double {
+        int fds[2];
+        if (pipe(fds)) {
+            return NAN;
+        }
+        pid_t pid = fork();
+        if (pid == 0) {
+            dup2(fds[1], STDOUT_FILENO);
+            execl("/proc/self/exe", "bench_decode", "--child", mode.c_str(), path.c_str(),
+                  static_cast<char*>(nullptr));
+            _exit(1);
+        }
+        close(fds[1]);
+
+        char buffer[32] = {};
+        ssize_t size = (pid < 0) ? -1 : read(fds[0], buffer, sizeof(buffer) - 1);
+        close(fds[0]);
+        int status = 0;
+        if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+            WEXITSTATUS(status) || size <= 0) {
+            return NAN;
+        }
+        return std::atol(buffer) / 1024.0;
+    };
+    return run(decoder) - run("none");
+}
+
+// Seconds per decode, averaged over |runs|.
+template <class F>
+double Measure(F&& decode, size_t runs) {
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < runs; ++i) {
+        decode();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count() / runs;
+}
+
+void Report(const std::string& path, size_t runs) {
+    std::string data = ReadFile(path);
+
+    Image own = DecodeOwn(data);
+    Reference reference = DecodeReference(data);
+    if (own.Width() != reference.width || own.Height() != reference.height) {
+        throw std::runtime_error("Decoders disagree on size");
+    }
+
+    double squares = 0;
+    int max_error = 0;
+    for (size_t y = 0; y < own.Height(); ++y) {
+        for (size_t x = 0; x < own.Width(); ++x) {
+            RGB pixel = own.GetPixel(y, x);
+            const uint8_t* expected = reference.rgb.data() + (y * own.Width() + x) * 3;
+            for (int value :
+                 {pixel.r - expected[0], pixel.g - expected[1], pixel.b - expected[2]}) {
+                squares += value * value;
+                max_error = std::max(max_error, std::abs(value));
+            }
+        }
+    }
+    double mse = squares / (own.Width() * own.Height() * 3);
+    double psnr = mse ? 10 * std::log10(255.0 * 255.0 / mse) : INFINITY;
+
+    double own_seconds = Measure([&] { DecodeOwn(data); }, runs);
+    double reference_seconds = Measure([&] { DecodeReference(data); }, runs);
+
+    // timers slow the decode down, so the breakdown comes from a pass of its own
+    EnableStageTimes(true);
+    ResetStageTimes();
+    double timed_seconds = Measure([&] { DecodeOwn(data); }, runs);
+    auto stages = GetStageTimes();
+    EnableStageTimes(false);
+
+    double megabytes = data.size() / 1e6, megapixels = own.Width() * own.Height() / 1e6;
+    double own_memory = PeakMemory("decoder", path);
+    double reference_memory = PeakMemory("libjpeg-turbo", path);
+
+    std::printf("%s %zux%zu\n", path.c_str(), own.Width(), own.Height());
+    const char* format = "  %-14s %8.2f MB/s %8.2f MP/s %8.1f MiB peak RSS\n";
+    std::printf(format, "decoder", megabytes / own_seconds, megapixels / own_seconds,
+                own_memory);
+    std::printf(format, "libjpeg-turbo", megabytes / reference_seconds,
+                megapixels / reference_seconds, reference_memory);
+    std::printf("  PSNR %.2f dB, max abs error %d\n", psnr, max_error);
+
+    double total = (stages[0] + stages[1] + stages[2]) / 1e9 / runs;
+    if (total > 0) {
+        std::printf("  stages: entropy %.1f%%, idct %.1f%%, color %.1f%%, other %.1f%%\n",
+                    100.0 * stages[0] / 1e9 / runs / timed_seconds,
+                    100.0 * stages[1] / 1e9 / runs / timed_seconds,
+                    100.0 * stages[2] / 1e9 / runs / timed_seconds,
+                    100.0 * std::max(0.0, timed_seconds - total) / timed_seconds);
+    }
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    if (argc == 4 && std::strcmp(argv[1], "--child") == 0) {
+        std::string mode = argv[2], data = ReadFile(argv[3]);
+        if (mode == "decoder") {
+            DecodeOwn(data);
+        } else if (mode == "libjpeg-turbo") {
+            DecodeReference(data);
+        }
+        std::printf("%ld\n", PeakResidentKb());
+        return 0;
+    }
+
+    size_t runs = 10;
+    int first = 1;
+    if (argc > 2 && std::strcmp(argv[1], "-n") == 0) {
+        runs = std::max(1, std::atoi(argv[2]));
+        first = 3;
+    }
+    if (first >= argc) {
+        std::fprintf(stderr, "Usage: %s [-n runs] files...\n", argv[0]);
+        return 2;
+    }
+
+    int failed = 0;
+    for (int i = first; i < argc; ++i) {
+        try {
+            Report(argv[i], runs);
+        } catch (const std::exception& e) {
+            std::printf("%s failed: %s\n", argv[i], e.what());
+            ++failed;
+        }
+    }
+    return failed ? 1 : 0;
+}
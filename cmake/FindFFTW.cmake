@@ -2,7 +2,7 @@
 # Find the native FFTW includes and library
 #
 #  FFTW_INCLUDES    - where to find fftw3.h
-#  FFTW_LIBRARIES   - List of libraries when using FFTW.
+#  FFTW_LIBRARIES   - List of libraries when using FFTW (double and single precision).
 #  FFTW_FOUND       - True if FFTW found.
 
 if (FFTW_INCLUDES)
@@ -12,11 +12,16 @@ endif (FFTW_INCLUDES)
 
 find_path (FFTW_INCLUDES fftw3.h)
 
-find_library (FFTW_LIBRARIES NAMES fftw3)
+find_library (FFTW_DOUBLE_LIBRARY NAMES fftw3)
+find_library (FFTW_FLOAT_LIBRARY NAMES fftw3f)
+
+if (FFTW_DOUBLE_LIBRARY AND FFTW_FLOAT_LIBRARY)
+  set (FFTW_LIBRARIES ${FFTW_DOUBLE_LIBRARY} ${FFTW_FLOAT_LIBRARY})
+endif ()
 
 # handle the QUIETLY and REQUIRED arguments and set FFTW_FOUND to TRUE if
 # all listed variables are TRUE
 include (FindPackageHandleStandardArgs)
 find_package_handle_standard_args (FFTW DEFAULT_MSG FFTW_LIBRARIES FFTW_INCLUDES)
 
-mark_as_advanced (FFTW_LIBRARIES FFTW_INCLUDES)
+mark_as_advanced (FFTW_LIBRARIES FFTW_DOUBLE_LIBRARY FFTW_FLOAT_LIBRARY FFTW_INCLUDES)
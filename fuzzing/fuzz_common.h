@@ -0,0 +1,56 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include "options.h"
+
+// Keeps a single input from exhausting fuzzer memory or time,
+// the interesting failures are crashes and sanitizer reports, not big images.
+inline DecodeLimits FuzzLimits() {
+    DecodeLimits limits;
+    limits.max_pixels = 1 << 20;
+    limits.max_memory = 256 << 20;
+    limits.max_mcus = 1 << 14;
+    return limits;
+}
+
+class SlowUnitDetector {
+    /*
+            Flags inputs whose processing time per byte exceeds the threshold
+            (JPEG_FUZZ_SLOW_NS_PER_BYTE, 100us by default) by aborting, so libFuzzer
+            keeps them as crash artifacts. Catches algorithmic blowups, which a plain
+            -timeout misses when the input is small but still too slow for its size.
+    */
+public:
+    explicit SlowUnitDetector(size_t size) : size_(size) {
+        if (const char* env = std::getenv("JPEG_FUZZ_SLOW_NS_PER_BYTE")) {
+            ns_per_byte_ = std::stoull(env);
+        }
+    }
+
+    ~SlowUnitDetector() {
+        auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                           std::chrono::steady_clock::now() - start_)
+                           .count();
+        size_t budget = ns_per_byte_ * std::max(size_, kMinBytes);
+
+        if (ns_per_byte_ && static_cast<size_t>(elapsed) > budget) {
+            std::fprintf(stderr, "==SLOW UNIT== %zu bytes took %lld ns, budget %zu ns\n", size_,
+                         static_cast<long long>(elapsed), budget);
+            std::abort();
+        }
+    }
+
+private:
+    // fixed per input cost (FFTW planning, allocations) is not charged to tiny inputs
+    constexpr static inline size_t kMinBytes = 1024;
+
+    size_t size_;
+    size_t ns_per_byte_ = 100'000;
+    std::chrono::steady_clock::time_point start_ = std::chrono::steady_clock::now();
+};
@@ -0,0 +1,25 @@
+#include <cstdint>
+#include <sstream>
+#include <string>
+
+#include "decoder.h"
+#include "fuzz_common.h"
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    SlowUnitDetector detector(size);
+    std::string bytes(reinterpret_cast<const char*>(data), size);
+
+    for (bool tolerant : {false, true}) {
+        std::istringstream input(bytes);
+        DecodeOptions options;
+        options.limits = FuzzLimits();
+        options.tolerant = tolerant;
+
+        try {
+            Decode(input, options);
+        } catch (const std::exception&) {
+        }
+    }
+
+    return 0;
+}
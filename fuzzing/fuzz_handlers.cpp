@@ -0,0 +1,95 @@
+#include <array>
+#include <cstdint>
+#include <vector>
+
+#include "fuzz_common.h"
+#include "marker_controller.h"
+
+namespace {
+
+// First input byte picks the handler, the rest is the section after its marker.
+constexpr std::array<SectionID, 8> kMarkers = {SectionID::DHT,  SectionID::DQT,
+                                               SectionID::SOF0, SectionID::SOF1,
+                                               SectionID::SOS,  SectionID::APP14,
+                                               SectionID::DRI,  SectionID::COM};
+
+void Handle(MarkerFactory& factory, SectionID marker, const uint8_t* data, size_t size,
+            PictureContext* context) {
+    std::vector<uint8_t> section = {static_cast<uint8_t>(static_cast<uint16_t>(marker) >> 8),
+                                    static_cast<uint8_t>(marker)};
+    section.insert(section.end(), data, data + size);
+
+    BitReader reader(&section);
+    reader.ReadDoubleByte();
+    factory.Handle(marker, reader, context);
+}
+
+std::vector<uint8_t> WithLength(std::vector<uint8_t> payload) {
+    uint16_t length = payload.size() + 2;
+    payload.insert(payload.begin(), {static_cast<uint8_t>(length >> 8),
+                                     static_cast<uint8_t>(length)});
+    return payload;
+}
+
+// SOS needs frame and tables: 16x16 picture, 4:2:0, flat DQT and
+// simple complete Huffman tables (all DC codes 4 bits, all AC codes 8 bits).
+void PrepareHeaders(MarkerFactory& factory, PictureContext* context) {
+    auto sof0 = WithLength({8, 0, 16, 0, 16, 3, 1, 0x22, 0, 2, 0x11, 0, 3, 0x11, 0});
+
+    std::vector<uint8_t> dqt = {0};
+    dqt.resize(1 + 64, 1);
+    dqt = WithLength(std::move(dqt));
+
+    std::vector<uint8_t> dht = {0x00};
+    std::array<uint8_t, 16> dc_lengths{};
+    dc_lengths[3] = 12;
+    dht.insert(dht.end(), dc_lengths.begin(), dc_lengths.end());
+    for (uint8_t value = 0; value < 12; ++value) {
+        dht.push_back(value);
+    }
+
+    dht.push_back(0x10);
+    std::array<uint8_t, 16> ac_lengths{};
+    ac_lengths[7] = 162;
+    dht.insert(dht.end(), ac_lengths.begin(), ac_lengths.end());
+    dht.push_back(0x00);
+    dht.push_back(0xF0);
+    for (uint8_t run = 0; run < 16; ++run) {
+        for (uint8_t len = 1; len <= 10; ++len) {
+            dht.push_back((run << 4) | len);
+        }
+    }
+    dht = WithLength(std::move(dht));
+
+    Handle(factory, SectionID::SOF0, sof0.data(), sof0.size(), context);
+    Handle(factory, SectionID::DQT, dqt.data(), dqt.size(), context);
+    Handle(factory, SectionID::DHT, dht.data(), dht.size(), context);
+}
+
+}  // namespace
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    if (size == 0) {
+        return 0;
+    }
+
+    SlowUnitDetector detector(size);
+
+    PictureContext context;
+    context.options.limits = FuzzLimits();
+    context.options.tolerant = data[0] & 0x80;
+
+    SectionID marker = kMarkers[(data[0] & 0x7F) % kMarkers.size()];
+    MarkerFactory factory;
+
+    try {
+        if (marker == SectionID::SOS) {
+            PrepareHeaders(factory, &context);
+        }
+        Handle(factory, marker, data + 1, size - 1, &context);
+        context.FinishScans();  // decodes a non-interleaved scan
+    } catch (const std::exception&) {
+    }
+
+    return 0;
+}
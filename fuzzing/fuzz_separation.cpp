@@ -0,0 +1,23 @@
+#include <cstdint>
+#include <sstream>
+#include <string>
+
+#include "fuzz_common.h"
+#include "marker_controller.h"
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    SlowUnitDetector detector(size);
+
+    std::istringstream input(std::string(reinterpret_cast<const char*>(data), size));
+    PictureContext context;
+    context.options.limits = FuzzLimits();
+    context.options.tolerant = size % 2;  // both separation modes from the same corpus
+
+    MarkerController controller(&input, &context);
+    try {
+        controller.Separate();
+    } catch (const std::exception&) {
+    }
+
+    return 0;
+}
@@ -1,7 +1,9 @@
 #pragma once
 
+#include <algorithm>
 #include <iostream>
 #include <optional>
+#include <stdexcept>
 #include <vector>
 
 constexpr uint8_t kBitsInByte = 8;
@@ -24,6 +26,32 @@ public:
         return input_->eof();
     }
 
+    // Takes up to |size| bytes the stream already holds in its buffer, refilling the buffer
+    // first if it is empty. Returns 0 at the end of input.
+    size_t ReadBuffered(uint8_t* data, size_t size) {
+        std::streambuf* buffer = input_->rdbuf();
+        if (!*input_ || !buffer ||
+            std::istream::traits_type::eq_int_type(buffer->sgetc(),
+                                                   std::istream::traits_type::eof())) {
+            input_->setstate(std::ios::eofbit | std::ios::failbit);
+            return 0;
+        }
+        // at least the byte seen by sgetc is there
+        std::streamsize available = std::max<std::streamsize>(buffer->in_avail(), 1);
+        return buffer->sgetn(reinterpret_cast<char*>(data),
+                             std::min<std::streamsize>(available, size));
+    }
+
+    // Gives back the last |size| bytes of ReadBuffered, they are still in the stream buffer.
+    void Unread(size_t size) {
+        for (size_t i = 0; i < size; ++i) {
+            if (std::istream::traits_type::eq_int_type(input_->rdbuf()->sungetc(),
+                                                       std::istream::traits_type::eof())) {
+                throw std::runtime_error("Cannot return bytes to the input");
+            }
+        }
+    }
+
 private:
     std::istream* input_;
 };
@@ -47,6 +75,18 @@ public:
         return index_ == input_->size();
     }
 
+    size_t Position() const {
+        return index_;
+    }
+
+    size_t Size() const {
+        return input_->size();
+    }
+
+    void Seek(size_t index) {
+        index_ = std::min(index, input_->size());
+    }
+
 private:
     const std::vector<uint8_t>* input_;
     size_t index_ = 0;
@@ -58,6 +98,10 @@ public:
     BitReader(InputType* input) : input_(InputWrapper<InputType>(input)) {
     }
 
+    // Byte vectors are only read.
+    BitReader(const InputType* input) : input_(InputWrapper<InputType>(input)) {
+    }
+
     bool ReadBit() {
         if (position_ == kBitsInByte) {
             position_ = 0;
@@ -95,6 +139,41 @@ public:
         return input_.IsEnd();
     }
 
+    // Drops the rest of current byte, next read starts from a byte boundary.
+    void AlignToByte() {
+        position_ = kBitsInByte;
+    }
+
+    // Index of the next byte to be loaded, available for random access inputs.
+    size_t BytePosition() const {
+        return input_.Position();
+    }
+
+    void SeekByte(size_t index) {
+        AlignToByte();
+        input_.Seek(index);
+    }
+
+    // Size of random access input in bytes.
+    size_t ByteSize() const {
+        return input_.Size();
+    }
+
+    // Number of bits consumed from the start of random access input.
+    size_t BitPosition() const {
+        return input_.Position() * kBitsInByte - (kBitsInByte - position_);
+    }
+
+    void SeekBit(size_t bit) {
+        SeekByte(bit / kBitsInByte);
+        if (bit % kBitsInByte) {
+            if (!input_.ReadByte(buffer_)) {
+                throw std::runtime_error("Cannot read, seems like EOF");
+            }
+            position_ = bit % kBitsInByte;
+        }
+    }
+
     template <class CharType>
     void FillVector(std::vector<CharType>& bytes) {
         for (size_t i = 0; i < bytes.size(); ++i) {
@@ -102,6 +181,15 @@ public:
         }
     }
 
+    // Bulk reads of byte aligned input, see InputWrapper<std::istream>.
+    size_t ReadBuffered(uint8_t* data, size_t size) {
+        return input_.ReadBuffered(data, size);
+    }
+
+    void Unread(size_t size) {
+        input_.Unread(size);
+    }
+
     void FillString(std::string& str) {
         for (size_t i = 0; i < str.size(); ++i) {
             str[i] = ReadByte();
@@ -0,0 +1,157 @@
+#include "buffer_pool.h"
+
+#include <glog/logging.h>
+#include <cstring>
+#include <limits>
+#include <new>
+
+namespace {
+
+struct SizeClass {
+    size_t index;
+    size_t bytes;
+};
+
+SizeClass FindClass(size_t size) {
+    if (size > std::numeric_limits<size_t>::max() / 4) {
+        throw std::bad_alloc();
+    }
+    SizeClass result = {0, BufferPool::kMinClass};
+    while (result.bytes < size) {
+        // 2^k -> 1.5 * 2^k -> 2^(k + 1)
+        result.bytes = (result.index % 2 == 0) ? result.bytes + result.bytes / 2
+                                               : result.bytes / 3 * 4;
+        ++result.index;
+    }
+    return result;
+}
+
+size_t ClassBytes(size_t index) {
+    size_t result = BufferPool::kMinClass << (index / 2);
+    return (index % 2) ? result + result / 2 : result;
+}
+
+}  // namespace
+
+BufferPool::BufferPool(size_t capacity) : shelves_(std::make_shared<Shelves>()) {
+    shelves_->capacity = capacity;
+}
+
+BufferPool::Shelves::~Shelves() {
+    for (auto& buffers : free) {
+        for (uint8_t* data : buffers) {
+            Free(data);
+        }
+    }
+}
+
+PooledBuffer BufferPool::Acquire(size_t size) {
+    SizeClass size_class = FindClass(size);
+    {
+        std::lock_guard lock(shelves_->mutex);
+        if (size_class.index < shelves_->free.size() &&
+            !shelves_->free[size_class.index].empty()) {
+            uint8_t* data = shelves_->free[size_class.index].back();
+            shelves_->free[size_class.index].pop_back();
+            shelves_->idle_bytes -= size_class.bytes;
+            return PooledBuffer(shelves_, data, size_class.bytes);
+        }
+    }
+
+    DLOG(INFO) << "Allocating pooled buffer of " << size_class.bytes << " bytes";
+    return PooledBuffer(shelves_, Allocate(size_class.bytes), size_class.bytes);
+}
+
+void BufferPool::Reserve(size_t size, size_t count) {
+    // idle ones are taken first, so |count| buffers are there when these come back
+    std::vector<PooledBuffer> buffers;
+    buffers.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        buffers.push_back(Acquire(size));
+    }
+}
+
+void BufferPool::SetCapacity(size_t capacity) {
+    std::lock_guard lock(shelves_->mutex);
+    shelves_->capacity = capacity;
+    Trim(shelves_.get());
+}
+
+size_t BufferPool::IdleBytes() const {
+    std::lock_guard lock(shelves_->mutex);
+    return shelves_->idle_bytes;
+}
+
+size_t BufferPool::ClassSize(size_t size) {
+    return FindClass(size).bytes;
+}
+
+uint8_t* BufferPool::Allocate(size_t size) {
+    auto data = static_cast<uint8_t*>(::operator new(size, std::align_val_t(kAlignment)));
+    // faults every page in now rather than in the decode using it
+    std::memset(data, 0, size);
+    return data;
+}
+
+void BufferPool::Free(uint8_t* data) {
+    ::operator delete(data, std::align_val_t(kAlignment));
+}
+
+void BufferPool::Release(Shelves* shelves, uint8_t* data, size_t size) {
+    std::lock_guard lock(shelves->mutex);
+    if (shelves->idle_bytes + size > shelves->capacity) {
+        Free(data);
+        return;
+    }
+    try {
+        size_t index = FindClass(size).index;
+        if (shelves->free.size() <= index) {
+            shelves->free.resize(index + 1);
+        }
+        shelves->free[index].push_back(data);
+        shelves->idle_bytes += size;
+    } catch (const std::bad_alloc&) {
+        Free(data);
+    }
+}
+
+void BufferPool::Trim(Shelves* shelves) {
+    // largest buffers first, they are the least likely to fit the next request
+    for (size_t index = shelves->free.size(); index-- > 0;) {
+        auto& buffers = shelves->free[index];
+        while (shelves->idle_bytes > shelves->capacity && !buffers.empty()) {
+            Free(buffers.back());
+            buffers.pop_back();
+            shelves->idle_bytes -= ClassBytes(index);
+        }
+    }
+}
+
+PooledBuffer::~PooledBuffer() {
+    Reset();
+}
+
+PooledBuffer::PooledBuffer(PooledBuffer&& other) noexcept
+    : shelves_(std::move(other.shelves_)),
+      data_(std::exchange(other.data_, nullptr)),
+      size_(std::exchange(other.size_, 0)) {
+}
+
+PooledBuffer& PooledBuffer::operator=(PooledBuffer&& other) noexcept {
+    if (this != &other) {
+        Reset();
+        shelves_ = std::move(other.shelves_);
+        data_ = std::exchange(other.data_, nullptr);
+        size_ = std::exchange(other.size_, 0);
+    }
+    return *this;
+}
+
+void PooledBuffer::Reset() {
+    if (data_) {
+        BufferPool::Release(shelves_.get(), data_, size_);
+    }
+    shelves_.reset();
+    data_ = nullptr;
+    size_ = 0;
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+class PooledBuffer;
+
+class BufferPool {
+    /*
+            Output memory reused across decodes and threads. Image sized blocks are
+            mapped and unmapped by malloc on every decode, so each one faults its
+            pages in again. Buffers here are rounded up to size classes, faulted in
+            once when they are allocated and put on the free list of their class
+            when their handle is destroyed, so taking one is a lock and a pop.
+            Idle buffers beyond the capacity are freed. Handles may outlive the pool.
+    */
+public:
+    constexpr static inline size_t kDefaultCapacity = 256 << 20;  // idle bytes
+    constexpr static inline size_t kMinClass = 64 << 10;
+    constexpr static inline size_t kAlignment = 64;
+
+    explicit BufferPool(size_t capacity = kDefaultCapacity);
+
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    // At least |size| bytes, contents are unspecified.
+    PooledBuffer Acquire(size_t size);
+
+    // Allocates buffers for |count| acquisitions of |size| bytes ahead of the first decodes.
+    void Reserve(size_t size, size_t count);
+
+    // Frees idle buffers beyond |capacity| bytes, 0 disables pooling.
+    void SetCapacity(size_t capacity);
+
+    size_t IdleBytes() const;
+
+    // Size classes are kMinClass times powers of two and halfway between them,
+    // so a buffer is at most half as large again as asked for.
+    static size_t ClassSize(size_t size);
+
+private:
+    friend class PooledBuffer;
+
+    struct Shelves {
+        ~Shelves();
+
+        std::mutex mutex;
+        size_t capacity = 0;
+        size_t idle_bytes = 0;
+        std::vector<std::vector<uint8_t*>> free;  // by size class
+    };
+
+    static uint8_t* Allocate(size_t size);
+    static void Free(uint8_t* data);
+    static void Release(Shelves* shelves, uint8_t* data, size_t size);
+    static void Trim(Shelves* shelves);
+
+private:
+    std::shared_ptr<Shelves> shelves_;
+};
+
+class PooledBuffer {
+    /*
+            Handle of a BufferPool buffer, which goes back to the pool when the handle
+            is destroyed. Move only.
+    */
+public:
+    PooledBuffer() = default;
+    ~PooledBuffer();
+
+    PooledBuffer(PooledBuffer&& other) noexcept;
+    PooledBuffer& operator=(PooledBuffer&& other) noexcept;
+
+    uint8_t* Data() const {
+        return data_;
+    }
+
+    // Of the size class, not less than requested.
+    size_t Size() const {
+        return size_;
+    }
+
+private:
+    friend class BufferPool;
+
+    PooledBuffer(std::shared_ptr<BufferPool::Shelves> shelves, uint8_t* data, size_t size)
+        : shelves_(std::move(shelves)), data_(data), size_(size) {
+    }
+
+    void Reset();
+
+private:
+    std::shared_ptr<BufferPool::Shelves> shelves_;
+    uint8_t* data_ = nullptr;
+    size_t size_ = 0;
+};
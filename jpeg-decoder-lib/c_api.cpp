@@ -0,0 +1,265 @@
+#include "c_api.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <istream>
+#include <new>
+#include <stdexcept>
+#include <string>
+
+#include "decoder.h"
+
+namespace {
+
+// Reads caller memory in place, the whole input is one get area.
+class MemoryBuffer : public std::streambuf {
+public:
+    void Reset(const uint8_t* data, size_t size) {
+        char* begin = reinterpret_cast<char*>(const_cast<uint8_t*>(data));
+        setg(begin, begin, begin + size);
+    }
+};
+
+}  // namespace
+
+struct jd_decoder {
+    const uint8_t* data = nullptr;
+    size_t size = 0;
+    DecodeOptions options;
+    size_t valid_rows = 0;
+    std::string error;
+};
+
+namespace {
+
+jd_status Fail(jd_decoder* decoder, jd_status status, const char* message) {
+    try {
+        decoder->error = message;
+    } catch (...) {
+        decoder->error.clear();
+    }
+    return status;
+}
+
+// Runs |body| on a decoder over the input, turning exceptions into statuses.
+template <class F>
+jd_status Run(jd_decoder* decoder, F&& body) {
+    if (!decoder->data) {
+        return Fail(decoder, JD_ERROR_INVALID_ARGUMENT, "No input");
+    }
+    try {
+        MemoryBuffer buffer;
+        buffer.Reset(decoder->data, decoder->size);
+        std::istream input(&buffer);
+        Decoder instance(input, decoder->options);
+        return body(instance);
+    } catch (const LimitExceededError& e) {
+        return Fail(decoder, JD_ERROR_LIMIT_EXCEEDED, e.what());
+    } catch (const std::invalid_argument& e) {
+        return Fail(decoder, JD_ERROR_INVALID_INPUT, e.what());
+    } catch (const std::runtime_error& e) {
+        return Fail(decoder, JD_ERROR_INVALID_INPUT, e.what());  // input ended early
+    } catch (const std::bad_alloc&) {
+        return Fail(decoder, JD_ERROR_OUT_OF_MEMORY, "Out of memory");
+    } catch (const std::exception& e) {
+        return Fail(decoder, JD_ERROR_INTERNAL, e.what());
+    } catch (...) {
+        return Fail(decoder, JD_ERROR_INTERNAL, "Unknown error");
+    }
+}
+
+jd_color_space ToColorSpace(ColorSpace color_space) {
+    switch (color_space) {
+        case ColorSpace::Grayscale:
+            return JD_COLOR_GRAYSCALE;
+        case ColorSpace::YCbCr:
+            return JD_COLOR_YCBCR;
+        case ColorSpace::RGB:
+            return JD_COLOR_RGB;
+        case ColorSpace::CMYK:
+            return JD_COLOR_CMYK;
+        case ColorSpace::YCCK:
+            return JD_COLOR_YCCK;
+    }
+    throw std::logic_error("Unknown color space");
+}
+
+}  // namespace
+
+void jd_options_init(jd_options* options) {
+    DecodeOptions defaults;
+    *options = {};
+    options->size = sizeof(jd_options);
+    options->scale_denominator = defaults.scale_denominator;
+    options->resize_filter = JD_FILTER_LANCZOS3;
+}
+
+void jd_info_init(jd_info* info) {
+    *info = {};
+    info->size = sizeof(jd_info);
+}
+
+jd_decoder* jd_decoder_create(void) {
+    return new (std::nothrow) jd_decoder;
+}
+
+void jd_decoder_destroy(jd_decoder* decoder) {
+    delete decoder;
+}
+
+void jd_decoder_reset(jd_decoder* decoder) {
+    if (decoder) {
+        decoder->data = nullptr;
+        decoder->size = 0;
+        decoder->options = {};
+        decoder->valid_rows = 0;
+        decoder->error.clear();
+    }
+}
+
+jd_status jd_decoder_set_input(jd_decoder* decoder, const uint8_t* data, size_t size) {
+    if (!decoder) {
+        return JD_ERROR_INVALID_ARGUMENT;
+    }
+    if (!data && size) {
+        return Fail(decoder, JD_ERROR_INVALID_ARGUMENT, "No input data");
+    }
+    decoder->data = data ? data : reinterpret_cast<const uint8_t*>("");
+    decoder->size = size;
+    decoder->error.clear();
+    return JD_OK;
+}
+
+jd_status jd_decoder_set_options(jd_decoder* decoder, const jd_options* options) {
+    if (!decoder) {
+        return JD_ERROR_INVALID_ARGUMENT;
+    }
+    if (!options) {
+        return Fail(decoder, JD_ERROR_INVALID_ARGUMENT, "No options");
+    }
+
+    // fields the caller does not know about keep their defaults
+    jd_options known;
+    jd_options_init(&known);
+    std::memcpy(&known, options, std::min(options->size, sizeof(jd_options)));
+
+    DecodeOptions& result = decoder->options;
+    result = {};
+    result.scale_denominator = known.scale_denominator;
+    result.first_row = known.first_row;
+    result.row_count = known.row_count;
+    result.first_column = known.first_column;
+    result.column_count = known.column_count;
+    result.output_width = known.output_width;
+    result.output_height = known.output_height;
+    switch (known.resize_filter) {
+        case JD_FILTER_BOX:
+            result.resize_filter = ResizeFilter::Box;
+            break;
+        case JD_FILTER_BILINEAR:
+            result.resize_filter = ResizeFilter::Bilinear;
+            break;
+        case JD_FILTER_LANCZOS3:
+            result.resize_filter = ResizeFilter::Lanczos3;
+            break;
+        default:
+            return Fail(decoder, JD_ERROR_INVALID_ARGUMENT, "Unknown resize filter");
+    }
+    result.tolerant = known.tolerant;
+    result.apply_orientation = known.apply_orientation;
+    result.limits.max_pixels = known.max_pixels;
+    result.limits.max_memory = known.max_memory;
+    result.limits.max_time = std::chrono::milliseconds(known.max_time_ms);
+
+    decoder->error.clear();
+    return JD_OK;
+}
+
+jd_status jd_probe(jd_decoder* decoder, jd_info* info) {
+    if (!decoder) {
+        return JD_ERROR_INVALID_ARGUMENT;
+    }
+    if (!info) {
+        return Fail(decoder, JD_ERROR_INVALID_ARGUMENT, "No info");
+    }
+
+    return Run(decoder, [&](Decoder& instance) {
+        PictureInfo picture = instance.Probe();
+
+        jd_info result;
+        jd_info_init(&result);
+        result.width = picture.width;
+        result.height = picture.height;
+        result.output_width = picture.output_width;
+        result.output_height = picture.output_height;
+        result.channels = picture.channels;
+        result.precision = picture.precision;
+        result.orientation = picture.orientation;
+        result.color_space = ToColorSpace(picture.color_space);
+        result.has_thumbnail = picture.has_thumbnail;
+
+        // the caller's size stays, fields past it are not touched
+        result.size = info->size;
+        std::memcpy(info, &result, std::min(info->size, sizeof(jd_info)));
+        decoder->error.clear();
+        return JD_OK;
+    });
+}
+
+jd_status jd_decode_into(jd_decoder* decoder, uint8_t* pixels, size_t size, size_t stride,
+                         jd_format format) {
+    if (!decoder) {
+        return JD_ERROR_INVALID_ARGUMENT;
+    }
+    if (!pixels) {
+        return Fail(decoder, JD_ERROR_INVALID_ARGUMENT, "No output buffer");
+    }
+    switch (format) {
+        case JD_FORMAT_RGB8:
+            decoder->options.output_format = PixelFormat::RGB8;
+            break;
+        case JD_FORMAT_GRAY8:
+            decoder->options.output_format = PixelFormat::Gray8;
+            break;
+        case JD_FORMAT_RGB16:
+            decoder->options.output_format = PixelFormat::RGB16;
+            break;
+        case JD_FORMAT_GRAY16:
+            decoder->options.output_format = PixelFormat::Gray16;
+            break;
+        default:
+            return Fail(decoder, JD_ERROR_INVALID_ARGUMENT, "Unknown pixel format");
+    }
+    if (Image::Is16Bit(decoder->options.output_format) &&
+        (stride % 2 || reinterpret_cast<uintptr_t>(pixels) % 2)) {
+        return Fail(decoder, JD_ERROR_INVALID_ARGUMENT, "16-bit rows must be 2-byte aligned");
+    }
+    decoder->valid_rows = 0;
+
+    return Run(decoder, [&](Decoder& instance) {
+        // checked here to tell a small buffer from a broken picture
+        PictureInfo picture = instance.Probe();
+        if (!Image::FitsBuffer(picture.output_width, picture.output_height,
+                               decoder->options.output_format, stride, size)) {
+            return Fail(decoder, JD_ERROR_BUFFER_TOO_SMALL, "Output buffer is too small");
+        }
+
+        instance.DecodeInto(pixels, size, stride);
+        const DecodeStatus& status = instance.GetStatus();
+        decoder->valid_rows = status.valid_rows;
+        if (!status.complete) {
+            return Fail(decoder, JD_PARTIAL, status.error.c_str());
+        }
+        decoder->error.clear();
+        return JD_OK;
+    });
+}
+
+size_t jd_valid_rows(const jd_decoder* decoder) {
+    return decoder ? decoder->valid_rows : 0;
+}
+
+const char* jd_last_error(const jd_decoder* decoder) {
+    return decoder ? decoder->error.c_str() : "No decoder";
+}
@@ -0,0 +1,128 @@
+#pragma once
+
+/*
+        C interface for bindings from other languages. Functions never throw, they
+        return a status and keep the message of the last failure in the decoder.
+        Input is read in place and pixels are decoded straight into the buffer of
+        the caller, nothing of the image size is allocated or copied in between.
+
+            jd_decoder* decoder = jd_decoder_create();
+            jd_decoder_set_input(decoder, data, size);
+            jd_info info;
+            jd_info_init(&info);
+            jd_probe(decoder, &info);
+            size_t stride = info.output_width * 3;
+            uint8_t* pixels = malloc(stride * info.output_height);
+            jd_decode_into(decoder, pixels, stride * info.output_height, stride,
+                           JD_FORMAT_RGB8);
+            jd_decoder_destroy(decoder);
+
+        A decoder is used by one thread at a time, separate decoders run concurrently.
+        Structures are only extended at the end, their |size| field set by the init
+        functions tells which fields the caller knows about.
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct jd_decoder jd_decoder;
+
+typedef enum jd_status {
+    JD_OK = 0,
+    JD_PARTIAL = 1,                  // tolerant mode: damaged areas are gray, missing rows black
+    JD_ERROR_INVALID_ARGUMENT = -1,  // null pointer, unknown format, odd 16-bit rows, no input
+    JD_ERROR_BUFFER_TOO_SMALL = -2,  // stride or size of the output buffer
+    JD_ERROR_INVALID_INPUT = -3,     // malformed or unsupported picture, or options it rejects
+    JD_ERROR_LIMIT_EXCEEDED = -4,
+    JD_ERROR_OUT_OF_MEMORY = -5,
+    JD_ERROR_INTERNAL = -6,
+} jd_status;
+
+typedef enum jd_format {
+    JD_FORMAT_RGB8 = 0,    // r, g, b bytes
+    JD_FORMAT_GRAY8 = 1,   // one byte
+    JD_FORMAT_RGB16 = 2,   // r, g, b native endian uint16_t, up to 4095 for 12-bit pictures
+    JD_FORMAT_GRAY16 = 3,  // one uint16_t, 8-bit formats need 8-bit pictures
+} jd_format;
+
+typedef enum jd_color_space {
+    JD_COLOR_GRAYSCALE = 0,
+    JD_COLOR_YCBCR = 1,
+    JD_COLOR_RGB = 2,
+    JD_COLOR_CMYK = 3,
+    JD_COLOR_YCCK = 4,
+} jd_color_space;
+
+typedef enum jd_resize_filter {
+    JD_FILTER_BOX = 0,
+    JD_FILTER_BILINEAR = 1,
+    JD_FILTER_LANCZOS3 = 2,
+} jd_resize_filter;
+
+// Mirrors DecodeOptions, jd_options_init sets its defaults.
+typedef struct jd_options {
+    size_t size;  // sizeof(jd_options), set by jd_options_init
+    uint32_t scale_denominator;
+    uint32_t first_row;
+    uint32_t row_count;
+    uint32_t first_column;
+    uint32_t column_count;
+    uint32_t output_width;
+    uint32_t output_height;
+    jd_resize_filter resize_filter;
+    int tolerant;
+    int apply_orientation;
+    uint64_t max_pixels;
+    uint64_t max_memory;
+    uint32_t max_time_ms;
+} jd_options;
+
+typedef struct jd_info {
+    size_t size;     // sizeof(jd_info), set by jd_info_init
+    uint32_t width;  // as stored, before scaling and orientation
+    uint32_t height;
+    uint32_t output_width;  // of jd_decode_into with the current options
+    uint32_t output_height;
+    uint32_t channels;
+    uint32_t precision;
+    uint32_t orientation;  // EXIF tag, 1 when there is none
+    jd_color_space color_space;
+    int has_thumbnail;
+} jd_info;
+
+void jd_options_init(jd_options* options);
+void jd_info_init(jd_info* info);
+
+// Returns NULL if there is no memory.
+jd_decoder* jd_decoder_create(void);
+void jd_decoder_destroy(jd_decoder* decoder);
+
+// Forgets input, options and the last error, the decoder can take another picture.
+void jd_decoder_reset(jd_decoder* decoder);
+
+// |data| is borrowed, it must stay valid until the input is replaced or reset.
+jd_status jd_decoder_set_input(jd_decoder* decoder, const uint8_t* data, size_t size);
+jd_status jd_decoder_set_options(jd_decoder* decoder, const jd_options* options);
+
+// Reads the sections preceding the scan only.
+jd_status jd_probe(jd_decoder* decoder, jd_info* info);
+
+// Decodes the picture into |pixels| of |size| bytes, rows |stride| bytes apart.
+// 16-bit formats need |pixels| and |stride| to be even.
+// The buffer must hold output_height rows of output_width pixels, see jd_probe.
+jd_status jd_decode_into(jd_decoder* decoder, uint8_t* pixels, size_t size, size_t stride,
+                         jd_format format);
+
+// Rows from the top decoded without errors by the last jd_decode_into.
+size_t jd_valid_rows(const jd_decoder* decoder);
+
+// Message of the last failure or JD_PARTIAL result, empty after success.
+const char* jd_last_error(const jd_decoder* decoder);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,374 @@
+#include "coefficient_store.h"
+
+#include <algorithm>
+#include <cstring>
+#include <future>
+#include <stdexcept>
+
+#include "marker_controller.h"
+#include "table_cache.h"
+#include "thread_pool.h"
+
+namespace {
+
+constexpr uint32_t kMagic = 0x5343444A;  // "JDCS" in little endian
+constexpr uint32_t kVersion = 1;
+constexpr size_t kMaxChannels = 4;
+constexpr size_t kMaxThinning = 2;  // as SOF0 accepts
+
+// Arrays start at 4-byte boundaries, so mapped offsets are read in place.
+size_t Align(size_t size) {
+    return (size + sizeof(uint32_t) - 1) / sizeof(uint32_t) * sizeof(uint32_t);
+}
+
+// Data units of the channel in all MCUs of the picture.
+size_t CountBlocks(size_t width, size_t height, size_t max_h, size_t max_v, size_t h, size_t v) {
+    size_t mcu_width = max_h * kDataUnitSide, mcu_height = max_v * kDataUnitSide;
+    size_t mcus = ((width + mcu_width - 1) / mcu_width) * ((height + mcu_height - 1) / mcu_height);
+    return mcus * (max_h / h) * (max_v / v);
+}
+
+// Channels a color space is decoded from, as PictureContext::ResolveColorSpace assigns them.
+size_t ColorSpaceChannels(ColorSpace color_space) {
+    switch (color_space) {
+        case ColorSpace::Grayscale:
+            return 1;
+        case ColorSpace::YCbCr:
+        case ColorSpace::RGB:
+            return 3;
+        case ColorSpace::CMYK:
+        case ColorSpace::YCCK:
+            return 4;
+    }
+    return 0;
+}
+
+}  // namespace
+
+CoefficientStore CoefficientStore::Read(std::istream& input, const DecodeOptions& options) {
+    PictureContext context;
+    context.options.limits = options.limits;
+    context.options.tolerant = options.tolerant;
+
+    CoefficientStore store;
+    store.context_ = &context;
+    context.coefficients = &store;
+
+    MarkerController controller(&input, &context);
+    controller.SeparateAndProcess();
+
+    store.status_ = context.status;
+    store.Finish(context);
+    return store;
+}
+
+CoefficientStore CoefficientStore::Map(const uint8_t* data, size_t size) {
+    CoefficientStore store;
+    store.Attach(data, size);
+    return store;
+}
+
+template <class T>
+void CoefficientStore::Reserve(std::vector<T>& vector, size_t size) {
+    if (size <= vector.capacity()) {
+        return;
+    }
+    // doubling like push_back keeps the number of charges logarithmic
+    size_t capacity = std::max(size, vector.capacity() * 2);
+    if (context_) {
+        context_->ChargeStore((capacity - vector.capacity()) * sizeof(T));
+    }
+    vector.reserve(capacity);
+}
+
+void CoefficientStore::Put(size_t channel, size_t block, const int16_t* zigzag, size_t end) {
+    Pad(channel, block + 1);
+    std::vector<int16_t>& values = values_[channel];
+    Reserve(values, values.size() + end);
+    spans_[channel][block] = {static_cast<uint32_t>(values.size()),
+                              static_cast<uint32_t>(values.size() + end)};
+    values.insert(values.end(), zigzag, zigzag + end);
+}
+
+void CoefficientStore::Pad(size_t channel, size_t blocks) {
+    if (spans_.size() <= channel) {
+        spans_.resize(channel + 1);
+        values_.resize(channel + 1);
+    }
+
+    if (spans_[channel].size() < blocks) {
+        Reserve(spans_[channel], blocks);
+        spans_[channel].resize(blocks, {0, 0});
+    }
+}
+
+void CoefficientStore::Erase(size_t channel, size_t first, size_t count) {
+    Pad(channel, first + count);
+    std::fill_n(spans_[channel].begin() + first, count, BlockSpan{0, 0});
+}
+
+void CoefficientStore::Finish(const PictureContext& context) {
+    size_t max_h = context.mcu_width / kDataUnitSide, max_v = context.mcu_height / kDataUnitSide;
+    std::vector<ChannelInfo> infos;
+    std::vector<std::vector<uint32_t>> offsets(context.channels.size());
+    std::vector<std::vector<int16_t>> values(context.channels.size());
+    size_t size = sizeof(Header) + context.channels.size() * sizeof(ChannelInfo);
+
+    for (size_t c = 0; c < context.channels.size(); ++c) {
+        const Channel& channel = context.channels[c];
+        size_t blocks = CountBlocks(context.width, context.height, max_h, max_v,
+                                    channel.horizontal_thinning, channel.vertical_thinning);
+        Pad(c, blocks);  // MCUs after truncated scan
+
+        // blocks go to decoding order, values of erased blocks are dropped
+        size_t kept = 0;
+        for (size_t block = 0; block < blocks; ++block) {
+            kept += spans_[c][block].end - spans_[c][block].begin;
+        }
+        Reserve(offsets[c], blocks + 1);
+        Reserve(values[c], kept);
+        offsets[c].push_back(0);
+        for (size_t block = 0; block < blocks; ++block) {
+            const BlockSpan& span = spans_[c][block];
+            values[c].insert(values[c].end(), values_[c].begin() + span.begin,
+                             values_[c].begin() + span.end);
+            offsets[c].push_back(values[c].size());
+        }
+
+        auto it_qt = context.qts.find(channel.qt_id);
+        if (it_qt == context.qts.end()) {
+            throw std::invalid_argument("No QT with id: " + std::to_string(channel.qt_id));
+        }
+
+        infos.push_back({channel.id, channel.horizontal_thinning, channel.vertical_thinning,
+                         static_cast<uint32_t>(blocks),
+                         static_cast<uint32_t>(values[c].size()), it_qt->second->values});
+        size += Align((blocks + 1) * sizeof(uint32_t));
+        size += Align(values[c].size() * sizeof(int16_t));
+    }
+    spans_.clear();
+    values_.clear();
+
+    if (context_) {
+        context_->ChargeStore(size);
+        context_ = nullptr;  // the store may outlive the context
+    }
+    auto buffer = std::make_shared<std::vector<uint8_t>>(size, 0);
+    uint8_t* out = buffer->data();
+    auto write = [&](const void* data, size_t bytes) {
+        if (bytes) {
+            std::memcpy(out, data, bytes);
+        }
+        out += Align(bytes);
+    };
+
+    Header header{kMagic,
+                  kVersion,
+                  context.width,
+                  context.height,
+                  context.precision,
+                  static_cast<uint32_t>(context.color_space),
+                  static_cast<uint32_t>(infos.size()),
+                  0};
+    write(&header, sizeof(header));
+    write(infos.data(), infos.size() * sizeof(ChannelInfo));
+
+    for (size_t c = 0; c < infos.size(); ++c) {
+        write(offsets[c].data(), offsets[c].size() * sizeof(uint32_t));
+        write(values[c].data(), values[c].size() * sizeof(int16_t));
+    }
+
+    buffer_ = buffer;
+    Attach(buffer_->data(), buffer_->size());
+}
+
+void CoefficientStore::Attach(const uint8_t* data, size_t size) {
+    if (reinterpret_cast<uintptr_t>(data) % alignof(uint32_t)) {
+        throw std::invalid_argument("Coefficient store must be 4-byte aligned");
+    }
+
+    size_t position = 0;
+    auto take = [&](size_t bytes) {
+        if (size - position < bytes) {
+            throw std::invalid_argument("Coefficient store is truncated");
+        }
+        const uint8_t* result = data + position;
+        position += std::min(Align(bytes), size - position);
+        return result;
+    };
+
+    const Header* header = reinterpret_cast<const Header*>(take(sizeof(Header)));
+    if (header->magic != kMagic || header->version != kVersion) {
+        throw std::invalid_argument("Not a coefficient store");
+    }
+    if (!header->width || !header->height || (header->precision != 8 && header->precision != 12) ||
+        header->color_space > static_cast<uint32_t>(ColorSpace::YCCK) || !header->channels ||
+        header->channels > kMaxChannels) {
+        throw std::invalid_argument("Coefficient store has invalid picture parameters");
+    }
+    // color conversion reads as many planes as the color space has
+    if (header->channels != ColorSpaceChannels(static_cast<ColorSpace>(header->color_space))) {
+        throw std::invalid_argument("Coefficient store color space does not match channels");
+    }
+
+    const ChannelInfo* infos =
+        reinterpret_cast<const ChannelInfo*>(take(header->channels * sizeof(ChannelInfo)));
+    size_t max_h = 0, max_v = 0;
+    for (size_t c = 0; c < header->channels; ++c) {
+        size_t h = infos[c].horizontal_thinning, v = infos[c].vertical_thinning;
+        if (h < 1 || h > kMaxThinning || v < 1 || v > kMaxThinning) {
+            throw std::invalid_argument("Coefficient store has invalid thinning");
+        }
+        max_h = std::max(max_h, h);
+        max_v = std::max(max_v, v);
+    }
+
+    std::vector<ChannelView> views;
+    for (size_t c = 0; c < header->channels; ++c) {
+        const ChannelInfo& info = infos[c];
+        if (max_h % info.horizontal_thinning || max_v % info.vertical_thinning ||
+            info.blocks != CountBlocks(header->width, header->height, max_h, max_v,
+                                       info.horizontal_thinning, info.vertical_thinning)) {
+            throw std::invalid_argument("Coefficient store has invalid block count");
+        }
+
+        const uint32_t* offsets = reinterpret_cast<const uint32_t*>(
+            take((static_cast<size_t>(info.blocks) + 1) * sizeof(uint32_t)));
+        const int16_t* values =
+            reinterpret_cast<const int16_t*>(take(info.values * sizeof(int16_t)));
+
+        if (offsets[0] || offsets[info.blocks] != info.values) {
+            throw std::invalid_argument("Coefficient store has invalid block offsets");
+        }
+        for (size_t block = 0; block < info.blocks; ++block) {
+            if (offsets[block] > offsets[block + 1] ||
+                offsets[block + 1] - offsets[block] > kDataUnitSize) {
+                throw std::invalid_argument("Coefficient store has invalid block offsets");
+            }
+        }
+
+        views.push_back({&info, offsets, values});
+    }
+
+    if (position != size) {
+        throw std::invalid_argument("Coefficient store has trailing data");
+    }
+
+    data_ = data;
+    size_ = size;
+    header_ = header;
+    views_ = std::move(views);
+}
+
+Image CoefficientStore::Render(const DecodeOptions& options) const {
+    PictureContext context;
+    context.options = options;
+    context.width = header_->width;
+    context.height = header_->height;
+    context.precision = header_->precision;
+    context.color_space = GetColorSpace();
+
+    size_t max_h = 0, max_v = 0;
+    for (size_t c = 0; c < views_.size(); ++c) {
+        const ChannelInfo& info = *views_[c].info;
+        context.channels.push_back({static_cast<uint8_t>(info.id),
+                                    static_cast<uint8_t>(info.horizontal_thinning),
+                                    static_cast<uint8_t>(info.vertical_thinning),
+                                    static_cast<uint8_t>(c)});
+        max_h = std::max<size_t>(max_h, info.horizontal_thinning);
+        max_v = std::max<size_t>(max_v, info.vertical_thinning);
+    }
+    context.mcu_width = max_h * kDataUnitSide;
+    context.mcu_height = max_v * kDataUnitSide;
+
+    context.PrepareImage();
+    RenderTo(context);
+    context.FinishImage();
+    return std::move(context.image);
+}
+
+void CoefficientStore::RenderTo(PictureContext& context) const {
+    const DecodeOptions& options = context.options;
+    std::vector<ScanChannel> scan_channels;
+    for (size_t c = 0; c < views_.size(); ++c) {
+        auto table = TableCache::Instance().GetQuantTable(views_[c].info->quant_table);
+        scan_channels.push_back({static_cast<uint8_t>(c), {}, {}, table->prescaled});
+    }
+
+    // only MCU rows of the band are touched, coefficients need no sequential decoding
+    size_t scale = options.scale_denominator;
+    size_t columns = (context.width + context.mcu_width - 1) / context.mcu_width;
+    size_t mcu_rows = (context.height + context.mcu_height - 1) / context.mcu_height;
+    size_t first_row = options.first_row * scale / context.mcu_height;
+    size_t end_row = std::min(mcu_rows, ((options.first_row + context.OutputHeight()) * scale +
+                                         context.mcu_height - 1) / context.mcu_height);
+
+    auto render_rows = [&](size_t begin, size_t end) {
+        MCUBlock block(context.mcu_height, context.mcu_width, &context,
+                       std::vector<ScanChannel>(scan_channels));
+        for (size_t row = begin; row < end; ++row) {
+            for (size_t column = 0; column < columns; ++column) {
+                block.Load(*this, row * context.mcu_height, column * context.mcu_width);
+                context.CountMCU();
+            }
+            block.FlushRow(row * context.mcu_height);
+        }
+    };
+
+    // resampling takes rows in order
+    size_t parts = (options.pool && !context.resampler)
+                       ? std::min(options.pool->Size(), end_row - first_row)
+                       : 1;
+    if (parts <= 1) {
+        render_rows(first_row, end_row);
+    } else {
+        std::vector<std::future<void>> futures;
+        for (size_t part = 0; part < parts; ++part) {
+            size_t begin = first_row + (end_row - first_row) * part / parts;
+            size_t end = first_row + (end_row - first_row) * (part + 1) / parts;
+            futures.push_back(options.pool->Submit([&, begin, end] { render_rows(begin, end); }));
+        }
+        WaitAll(futures);
+    }
+}
+
+const uint8_t* CoefficientStore::Data() const {
+    return data_;
+}
+
+size_t CoefficientStore::Size() const {
+    return size_;
+}
+
+size_t CoefficientStore::Width() const {
+    return header_->width;
+}
+
+size_t CoefficientStore::Height() const {
+    return header_->height;
+}
+
+size_t CoefficientStore::Precision() const {
+    return header_->precision;
+}
+
+ColorSpace CoefficientStore::GetColorSpace() const {
+    return static_cast<ColorSpace>(header_->color_space);
+}
+
+size_t CoefficientStore::Channels() const {
+    return views_.size();
+}
+
+const CoefficientStore::ChannelInfo& CoefficientStore::GetChannel(size_t channel) const {
+    return *views_.at(channel).info;
+}
+
+std::span<const int16_t> CoefficientStore::Block(size_t channel, size_t block) const {
+    const ChannelView& view = views_[channel];
+    return {view.values + view.offsets[block], view.values + view.offsets[block + 1]};
+}
+
+const DecodeStatus& CoefficientStore::GetStatus() const {
+    return status_;
+}
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <memory>
+#include <span>
+#include <vector>
+
+#include "context.h"
+#include "options.h"
+#include "utils/image.h"
+
+class CoefficientStore {
+    /*
+            Quantized DCT coefficients of a baseline picture. The scan is entropy
+            decoded once, then the picture is rendered at any scale, band or output
+            format with dequantization, IDCT and color conversion only.
+            Blocks keep coefficients in zigzag order up to the end of block, so a
+            typical block takes a few values. Everything lives in one flat buffer
+            of native byte order, which can be written to a file and mapped back.
+    */
+public:
+    struct ChannelInfo {
+        uint32_t id;  // component identifier from SOF0
+        uint32_t horizontal_thinning;
+        uint32_t vertical_thinning;
+        uint32_t blocks;
+        uint32_t values;                                  // stored coefficients of all blocks
+        std::array<uint16_t, kDataUnitSize> quant_table;  // natural order
+    };
+
+    // Reads the picture up to the end of its scan, throws like Decode. Only limits
+    // and tolerant options apply, damaged MCUs are stored as gray blocks. Collected
+    // coefficients count against max_memory as the store grows.
+    static CoefficientStore Read(std::istream& input, const DecodeOptions& options = {});
+
+    // Wraps bytes of Data(), e.g. a mapped file, without copying. They must stay
+    // valid and unchanged while the store is used. Throws std::invalid_argument
+    // on malformed data.
+    static CoefficientStore Map(const uint8_t* data, size_t size);
+
+    const uint8_t* Data() const;
+    size_t Size() const;
+
+    // Scale, band, output format, IDCT precision and limits are taken from |options|.
+    // With a pool MCU rows are rendered in parallel.
+    Image Render(const DecodeOptions& options = {}) const;
+
+    size_t Width() const;
+    size_t Height() const;
+    size_t Precision() const;
+    ColorSpace GetColorSpace() const;
+    size_t Channels() const;
+    const ChannelInfo& GetChannel(size_t channel) const;
+
+    // Blocks of a channel are in decoding order: MCU rows, MCUs of a row, units of an MCU.
+    std::span<const int16_t> Block(size_t channel, size_t block) const;
+
+    // Outcome of Read, always complete for mapped stores.
+    const DecodeStatus& GetStatus() const;
+
+private:
+    friend class MCUBlock;
+    friend class PictureContext;
+    friend class SectionSOS;
+
+    struct Header {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t width;
+        uint32_t height;
+        uint32_t precision;
+        uint32_t color_space;
+        uint32_t channels;
+        uint32_t reserved;
+    };
+
+    struct ChannelView {
+        const ChannelInfo* info;
+        const uint32_t* offsets;  // blocks + 1 entries
+        const int16_t* values;
+    };
+
+    struct BlockSpan {
+        uint32_t begin;  // in values of the channel
+        uint32_t end;
+    };
+
+    // Stores block of the channel. Blocks come in any order: MCU order for interleaved
+    // scans, raster order of the channel for non-interleaved ones, missing blocks are empty.
+    // Different channels may be stored concurrently once all of them are padded.
+    void Put(size_t channel, size_t block, const int16_t* zigzag, size_t end);
+
+    // Adds empty blocks to the channel up to |blocks|.
+    void Pad(size_t channel, size_t blocks);
+
+    // Replaces blocks [first, first + count) of damaged MCU, read or not, with empty ones.
+    void Erase(size_t channel, size_t first, size_t count);
+
+    // Lays collected blocks out in the flat buffer.
+    void Finish(const PictureContext& context);
+
+    void Attach(const uint8_t* data, size_t size);
+
+    // Grows capacity of |vector| to at least |size| elements, charging the growth to context_.
+    template <class T>
+    void Reserve(std::vector<T>& vector, size_t size);
+
+    // Renders band rows to the image allocated by PrepareImage of |context|.
+    void RenderTo(PictureContext& context) const;
+
+private:
+    std::vector<std::vector<BlockSpan>> spans_;  // while reading, per channel
+    std::vector<std::vector<int16_t>> values_;
+    PictureContext* context_ = nullptr;  // charged for memory while reading
+    std::shared_ptr<const std::vector<uint8_t>> buffer_;  // shared by copies, empty if mapped
+    const uint8_t* data_ = nullptr;
+    size_t size_ = 0;
+    const Header* header_ = nullptr;
+    std::vector<ChannelView> views_;
+    DecodeStatus status_;
+};
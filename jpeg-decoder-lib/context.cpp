@@ -1,53 +1,31 @@
 #include "context.h"
 
 #include <glog/logging.h>
+#include <cstdlib>
+#include <limits>
 #include <stdexcept>
 #include "bitreader.h"
-
-void DiagonalUnitIterator::Proceed() {
-    if ((x_ + y_) % 2) {
-        if (x_ + 1 == kDataUnitSide) {
-            ++y_;
-        } else if (y_ == 0) {
-            ++x_;
-        } else {
-            ++x_;
-            --y_;
-        }
-    } else {
-        if (y_ + 1 == kDataUnitSide) {
-            ++x_;
-        } else if (x_ == 0) {
-            ++y_;
-        } else {
-            --x_;
-            ++y_;
+#include "buffer_pool.h"
+#include "coefficient_store.h"
+#include "resampler.h"
+#include "stage_times.h"
+#include "thread_pool.h"
+#include "trace.h"
+
+QuantTable::QuantTable(const std::array<uint16_t, kDataUnitSize>& values) : values(values) {
+    for (size_t i = 0; i < kDataUnitSide; ++i) {
+        for (size_t j = 0; j < kDataUnitSide; ++j) {
+            size_t pos = i * kDataUnitSide + j;
+            prescaled[pos] = values[pos] * DctInputScale(i, j);
         }
     }
 }
 
-bool DiagonalUnitIterator::IsEnd() {
-    return (x_ >= kDataUnitSide || y_ >= kDataUnitSide);
-}
-
-DataUnit::Iterator& DataUnit::Iterator::operator++() {
-    gut_it_.Proceed();
-    return *this;
-}
-
-double& DataUnit::Iterator::operator*() {
-    auto [x, y] = gut_it_.Get();
-    return (*block_)[kDataUnitSide * x + y];
-}
-
-bool DataUnit::Iterator::IsEnd() {
-    return gut_it_.IsEnd();
-}
-
-void DataUnit::Read(BitReader<std::vector<uint8_t>>& reader, HuffmanTree dc_tree,
-                    HuffmanTree ac_tree) {
-
-    Iterator it(&block_);
+template <class Sink>
+void DataUnit::Decode(BitReader<std::vector<uint8_t>>& reader, ScanChannel& channel,
+                      int& prev_dc, Sink&& sink) {
+    constexpr int kMaxCoefLength = 15;
+    constexpr int kMaxDC = 1 << 16;  // keeps DC prediction from overflowing on garbage
 
     auto read_coef = [&](size_t len) {
         if (len == 0) {
@@ -74,13 +52,20 @@ void DataUnit::Read(BitReader<std::vector<uint8_t>>& reader, HuffmanTree dc_tree
     // read 1 DC coefficient and 63 AC coefficients
 
     int val;
-    while (!dc_tree.Move(reader.ReadBit(), val)) {
+    while (!channel.dc_tree.Move(reader.ReadBit(), val)) {
     }
-    (*it) = read_coef(static_cast<size_t>(val));
-    ++it;
+    if (val > kMaxCoefLength) {
+        throw std::invalid_argument("DC coefficient length is too big: " + std::to_string(val));
+    }
+    prev_dc += read_coef(static_cast<size_t>(val));  // read DC coef is shift relative to previous
+    if (std::abs(prev_dc) > kMaxDC) {
+        throw std::invalid_argument("DC coefficient is out of range");
+    }
+    sink(0, prev_dc);
 
-    while (!it.IsEnd()) {
-        while (!ac_tree.Move(reader.ReadBit(), val)) {
+    size_t index = 1;  // in zigzag order
+    while (index < kDataUnitSize) {
+        while (!channel.ac_tree.Move(reader.ReadBit(), val)) {
         }
 
         size_t nulls = static_cast<uint8_t>(val) >> (kBitsInByte / 2);
@@ -88,45 +73,123 @@ void DataUnit::Read(BitReader<std::vector<uint8_t>>& reader, HuffmanTree dc_tree
 
         if (nulls == 0 && len == 0) {
             // only zeros left
-            while (!it.IsEnd()) {
-                (*it) = 0;
-                ++it;
-            }
             break;
         }
 
         int16_t coef = read_coef(len);
 
-        while (nulls--) {
-            if (it.IsEnd()) {
-                throw std::invalid_argument("Too much zeros in data unit");
-            }
-            (*it) = 0;
-            ++it;
+        if (index + nulls > kDataUnitSize) {
+            throw std::invalid_argument("Too much zeros in data unit");
         }
+        index += nulls;
 
-        if (it.IsEnd()) {
+        if (index == kDataUnitSize) {
             throw std::invalid_argument("Not enough space for coefficient in data unit");
         }
-        (*it) = coef;
-        ++it;
+        sink(index++, coef);
     }
+}
+
+template <class T>
+void DataUnit::Read(BitReader<std::vector<uint8_t>>& reader, ScanChannel& channel, int& prev_dc,
+                    T* block, size_t side) {
+    std::fill(block, block + side * side, 0);
 
-    CHECK(it.IsEnd());
+    Decode(reader, channel, prev_dc, [&](size_t index, int coef) {
+        size_t pos = kZigzagOrder[index];
+        size_t row = pos / kDataUnitSide, col = pos % kDataUnitSide;
+        if (row < side && col < side) {
+            block[row * side + col] = coef * channel.qt[pos];
+        }
+    });
+}
+
+size_t DataUnit::ReadQuantized(BitReader<std::vector<uint8_t>>& reader, ScanChannel& channel,
+                               int& prev_dc, int16_t* zigzag) {
+    std::fill(zigzag, zigzag + kDataUnitSize, 0);
+
+    size_t end = 0;
+    Decode(reader, channel, prev_dc, [&](size_t index, int coef) {
+        if (coef < std::numeric_limits<int16_t>::min() ||
+            coef > std::numeric_limits<int16_t>::max()) {
+            throw std::invalid_argument("Coefficient is out of range");
+        }
+        zigzag[index] = coef;
+        end = index + 1;
+    });
+    return end;
+}
+
+template <class T>
+void DataUnit::Dequantize(const int16_t* zigzag, size_t end, const ScanChannel& channel,
+                          T* block, size_t side) {
+    std::fill(block, block + side * side, 0);
+
+    for (size_t index = 0; index < end; ++index) {
+        size_t pos = kZigzagOrder[index];
+        size_t row = pos / kDataUnitSide, col = pos % kDataUnitSide;
+        if (row < side && col < side) {
+            block[row * side + col] = zigzag[index] * channel.qt[pos];
+        }
+    }
 }
 
+template void DataUnit::Read<float>(BitReader<std::vector<uint8_t>>& reader,
+                                    ScanChannel& channel, int& prev_dc, float* block,
+                                    size_t side);
+template void DataUnit::Read<double>(BitReader<std::vector<uint8_t>>& reader,
+                                     ScanChannel& channel, int& prev_dc, double* block,
+                                     size_t side);
+template void DataUnit::Dequantize<float>(const int16_t* zigzag, size_t end,
+                                          const ScanChannel& channel, float* block, size_t side);
+template void DataUnit::Dequantize<double>(const int16_t* zigzag, size_t end,
+                                           const ScanChannel& channel, double* block,
+                                           size_t side);
+
 MCUBlock::MCUBlock(size_t height, size_t width, PictureContext* context,
-                   std::vector<HuffmanTree>&& dc_trees, std::vector<HuffmanTree>&& ac_trees)
+                   std::vector<ScanChannel>&& scan_channels)
     : height_(height),
       width_(width),
-      previous_dcs_(context->channels.size(), 0),
-      unit_before_idct_(),
-      unit_after_idct_(),
+      columns_((context->width + width - 1) / width),
+      scale_(context->options.scale_denominator),
+      side_(kDataUnitSide / scale_),
+      first_row_(context->options.first_row),
+      first_column_(context->options.first_column),
+      band_height_(context->OutputHeight()),
+      band_width_(context->OutputWidth()),
+      scan_channels_(std::move(scan_channels)),
+      gray_only_(context->IsGrayOnly()),
+      exact_(context->options.idct_precision == IdctPrecision::Double),
+      previous_dcs_(scan_channels_.size(), 0),
+      capture_(context->coefficients),
       context_(context),
-      dc_trees_(dc_trees),
-      ac_trees_(ac_trees),
-      idct_executor_(kDataUnitSide, &unit_before_idct_.block_, &unit_after_idct_.block_),
-      picture_piece_(height, width) {
+      picture_piece_(gray_only_ ? 0 : context->channels.size(), height / scale_, width / scale_) {
+    for (const auto& scan_channel : scan_channels_) {
+        const Channel& channel = context->channels[scan_channel.channel_id];
+        size_t units = (height / (channel.vertical_thinning * kDataUnitSide)) *
+                       (width / (channel.horizontal_thinning * kDataUnitSide));
+        units_.push_back(units);
+
+        // like libjpeg, subsampled channels use larger IDCT instead of upsampling when scaled
+        size_t side = side_;
+        if (side < kDataUnitSide &&
+            std::min(channel.horizontal_thinning, channel.vertical_thinning) > 1) {
+            side *= 2;
+        }
+        sides_.push_back(side);
+
+        // skipped chroma units are all decoded into a single scratch block
+        bool reconstructed =
+            !capture_ &&
+            (!gray_only_ || scan_channel.channel_id == static_cast<size_t>(ChannelNames::Y));
+        size_t row_units = reconstructed ? units * columns_ : 1;
+
+        if (exact_) {
+            double_rows_.emplace_back(side, row_units);
+        } else {
+            float_rows_.emplace_back(side, row_units);
+        }
+    }
 }
 
 size_t MCUBlock::GetHeight() const {
@@ -137,135 +200,376 @@ size_t MCUBlock::GetWidth() const {
     return width_;
 }
 
-void MCUBlock::Dequantize(size_t qt_id) {
-    auto it = context_->qts.find(qt_id);
-    if (it == context_->qts.end()) {
-        throw std::invalid_argument("No QT with id: " + std::to_string(qt_id));
-    }
-    auto& qt = it->second;
+template <>
+std::vector<DctCalculator<float>>& MCUBlock::Rows<float>() {
+    return float_rows_;
+}
 
-    for (size_t j = 0; j < kDataUnitSide * kDataUnitSide; ++j) {
-        unit_before_idct_.block_[j] *= qt[j];
-    }
+template <>
+std::vector<DctCalculator<double>>& MCUBlock::Rows<double>() {
+    return double_rows_;
 }
 
-void MCUBlock::ConvertToUnsignedScale(size_t precision) {
-    uint32_t shift = (1 << (precision - 1));
+template <class T>
+void MCUBlock::ConvertToUnsignedScale(T* data, size_t count, size_t precision) {
+    T shift = (1 << (precision - 1));
+    T max_value = (1 << precision) - 1;
 
-    for (size_t j = 0; j < kDataUnitSide * kDataUnitSide; ++j) {
-        unit_after_idct_.block_[j] = round(unit_after_idct_.block_[j]);
-        unit_after_idct_.block_[j] += shift;
-        unit_after_idct_.block_[j] = std::min(unit_after_idct_.block_[j], (1 << precision) - 1.0);
-        unit_after_idct_.block_[j] = std::max(unit_after_idct_.block_[j], 0.0);
+    for (size_t j = 0; j < count; ++j) {
+        data[j] = std::max(T(0), std::min(max_value, std::round(data[j]) + shift));
     }
 }
 
-void MCUBlock::ConvertToRGB(size_t x, size_t y, size_t channel_id) {
+template <class T>
+void MCUBlock::Upsample(const T* unit, size_t x, size_t y, size_t s) {
     // x, y - offsets in MCU
-    // YCbCr -> RGB
-    size_t prolong_w = context_->channels[channel_id].horizontal_thinning;
-    size_t prolong_h = context_->channels[channel_id].vertical_thinning;
+    size_t channel_id = scan_channels_[s].channel_id;
+    size_t side = sides_[s];
+    size_t prolong_w = context_->channels[channel_id].horizontal_thinning * side_ / side;
+    size_t prolong_h = context_->channels[channel_id].vertical_thinning * side_ / side;
 
-    for (size_t xshift = 0; xshift < kDataUnitSide; ++xshift) {
-        for (size_t yshift = 0; yshift < kDataUnitSide; ++yshift) {
+    for (size_t xshift = 0; xshift < side; ++xshift) {
+        for (size_t yshift = 0; yshift < side; ++yshift) {
             size_t i = x + xshift * prolong_h, j = y + yshift * prolong_w;
+            double val = unit[xshift * side + yshift];
 
             for (size_t h_add = 0; h_add < prolong_h; ++h_add) {
                 for (size_t w_add = 0; w_add < prolong_w; ++w_add) {
-                    double val = unit_after_idct_.Get(xshift, yshift);
-                    if (channel_id == static_cast<size_t>(ChannelNames::Y)) {
-                        picture_piece_.r[i + h_add][j + w_add] += val;
-                        picture_piece_.g[i + h_add][j + w_add] += val;
-                        picture_piece_.b[i + h_add][j + w_add] += val;
-                    } else if (channel_id == static_cast<size_t>(ChannelNames::Cb)) {
-                        picture_piece_.g[i + h_add][j + w_add] += -0.34414 * (val - 128);
-                        picture_piece_.b[i + h_add][j + w_add] += 1.772 * (val - 128);
-                    } else if (channel_id == static_cast<size_t>(ChannelNames::Cr)) {
-                        picture_piece_.r[i + h_add][j + w_add] += 1.402 * (val - 128);
-                        picture_piece_.g[i + h_add][j + w_add] += -0.71414 * (val - 128);
-                    } else {
-                        throw std::invalid_argument("Unrecognized channel id `" +
-                                                    std::to_string(channel_id) +
-                                                    "` while flushing to image:");
-                    }
+                    picture_piece_.Get(channel_id, i + h_add, j + w_add) = val;
                 }
             }
         }
     }
 }
 
-void RGBBlock::Clear() {
-    size_t height = r.size();
-    CHECK(height != 0) << "WTF, MCU height is zero?!";
+template <class T>
+void MCUBlock::WriteGray(const T* unit, size_t x, size_t y, size_t s, size_t img_y,
+                         size_t img_x) {
+    // grayscale fast path: unit goes straight to the image, without planes and color conversion
+    size_t channel_id = scan_channels_[s].channel_id;
+    size_t side = sides_[s];
+    size_t prolong_w = context_->channels[channel_id].horizontal_thinning * side_ / side;
+    size_t prolong_h = context_->channels[channel_id].vertical_thinning * side_ / side;
+    Image& img = context_->Canvas();
+    bool gray_output = Image::IsGray(img.Format());
+
+    for (size_t xshift = 0; xshift < side * prolong_h; ++xshift) {
+        if (img_y + x + xshift < first_row_) {
+            continue;
+        }
+        size_t row = img_y + x + xshift - first_row_;
+        if (row >= band_height_) {
+            break;
+        }
+
+        for (size_t yshift = 0; yshift < side * prolong_w; ++yshift) {
+            if (img_x + y + yshift < first_column_) {
+                continue;
+            }
+            size_t col = img_x + y + yshift - first_column_;
+            if (col >= band_width_) {
+                break;
+            }
 
-    size_t width = r[0].size();
-    r.assign(height, std::vector<double>(width, 0));
-    g.assign(height, std::vector<double>(width, 0));
-    b.assign(height, std::vector<double>(width, 0));
+            int val = unit[(xshift / prolong_h) * side + yshift / prolong_w];
+            auto [img_row, img_col] = context_->Place(row, col);
+            if (gray_output) {
+                img.SetGray(img_row, img_col, val);
+            } else {
+                img.SetPixel(img_row, img_col, {val, val, val});
+            }
+        }
+    }
 }
 
-void RGBBlock::FlushToImage(size_t y, size_t x, size_t precision, Image& img) {
-    size_t height = img.Height();
-    size_t width = img.Width();
+void RGBBlock::FlushToImage(size_t y, size_t x, const PictureContext& context, Image& img) {
+    size_t first_row = context.options.first_row, first_column = context.options.first_column;
+    size_t band_height = context.OutputHeight(), band_width = context.OutputWidth();
+    size_t precision = context.precision;
+    ColorSpace color_space = context.color_space;
+    double max_value = (1 << precision) - 1.0;
+    double half = 1 << (precision - 1);
 
-    for (size_t i = 0; i < r.size(); ++i) {
-        for (size_t j = 0; j < r[i].size(); ++j) {
-            if (y + i >= height || x + j >= width) {
-                break;
+    auto clamp = [&](double val) {
+        return static_cast<int>(std::max(0.0, std::min(max_value, round(val))));
+    };
+
+    auto convert = [&](size_t pos) -> RGB {
+        switch (color_space) {
+            case ColorSpace::Grayscale: {
+                int val = clamp(planes[0][pos]);
+                return {val, val, val};
+            }
+            case ColorSpace::RGB:
+                return {clamp(planes[0][pos]), clamp(planes[1][pos]), clamp(planes[2][pos])};
+            case ColorSpace::YCbCr:
+            case ColorSpace::YCCK: {
+                double luma = planes[static_cast<size_t>(ChannelNames::Y)][pos];
+                double cb = planes[static_cast<size_t>(ChannelNames::Cb)][pos] - half;
+                double cr = planes[static_cast<size_t>(ChannelNames::Cr)][pos] - half;
+                RGB pix{clamp(luma + 1.402 * cr), clamp(luma - 0.34414 * cb - 0.71414 * cr),
+                        clamp(luma + 1.772 * cb)};
+                if (color_space == ColorSpace::YCbCr) {
+                    return pix;
+                }
+                // YCCK keeps inverted CMY as YCbCr
+                double k = planes[static_cast<size_t>(ChannelNames::K)][pos];
+                return {clamp((max_value - pix.r) * k / max_value),
+                        clamp((max_value - pix.g) * k / max_value),
+                        clamp((max_value - pix.b) * k / max_value)};
             }
+            case ColorSpace::CMYK: {
+                // Adobe writes inverted CMYK, so plane values are already 1 - ink
+                double k = planes[static_cast<size_t>(ChannelNames::K)][pos];
+                return {clamp(planes[0][pos] * k / max_value),
+                        clamp(planes[1][pos] * k / max_value),
+                        clamp(planes[2][pos] * k / max_value)};
+            }
+        }
+        throw std::logic_error("Unknown color space");
+    };
 
-            auto& pix = img.GetPixel(y + i, x + j);
-            pix.r = std::max(0.0, std::min((1 << precision) - 1.0, round(r[i][j])));
-            pix.g = std::max(0.0, std::min((1 << precision) - 1.0, round(g[i][j])));
-            pix.b = std::max(0.0, std::min((1 << precision) - 1.0, round(b[i][j])));
+    bool gray_output = Image::IsGray(img.Format());
+
+    for (size_t i = 0; i < height && y + i < first_row + band_height; ++i) {
+        if (y + i < first_row) {
+            continue;
+        }
+        size_t row = y + i - first_row;
+
+        for (size_t j = 0; j < width && x + j < first_column + band_width; ++j) {
+            if (x + j < first_column) {
+                continue;
+            }
+            size_t col = x + j - first_column;
+
+            RGB pix = convert(i * width + j);
+            auto [img_row, img_col] = context.Place(row, col);
+            if (gray_output) {
+                img.SetGray(img_row, img_col, clamp(0.299 * pix.r + 0.587 * pix.g + 0.114 * pix.b));
+            } else {
+                img.SetPixel(img_row, img_col, pix);
+            }
         }
     }
 }
 
-void MCUBlock::Process(BitReader<std::vector<uint8_t>>& reader, size_t x, size_t y) {
-    picture_piece_.Clear();
+template <class T>
+void MCUBlock::Decode(BitReader<std::vector<uint8_t>>& reader, size_t column) {
+    auto& rows = Rows<T>();
 
-    for (size_t i = 0; i < context_->channels.size(); ++i) {
-        double& prev_dc = previous_dcs_[i];
-        size_t height_multiplier =
-            height_ / (context_->channels[i].vertical_thinning * kDataUnitSide);
-        size_t width_multiplier =
-            width_ / (context_->channels[i].horizontal_thinning * kDataUnitSide);
+    for (size_t s = 0; s < scan_channels_.size(); ++s) {
+        ScanChannel& scan_channel = scan_channels_[s];
+        bool reconstructed =
+            !gray_only_ || scan_channel.channel_id == static_cast<size_t>(ChannelNames::Y);
 
-        for (size_t j = 0; j < height_multiplier; ++j) {
-            for (size_t k = 0; k < width_multiplier; ++k) {
-                unit_before_idct_.Read(reader, dc_trees_[i], ac_trees_[i]);
+        for (size_t unit = 0; unit < units_[s]; ++unit) {
+            // chroma is entropy decoded only to advance the reader
+            size_t block = reconstructed ? column * units_[s] + unit : 0;
+            DataUnit::Read(reader, scan_channel, previous_dcs_[s], rows[s].Input(block),
+                           sides_[s]);
+        }
+    }
+}
 
-                unit_before_idct_.block_[0] +=
-                    prev_dc;  // read DC coef is shift relative to previous DC coef
-                prev_dc = unit_before_idct_.block_[0];
+template <class T>
+void MCUBlock::Reconstruct(size_t x) {
+    // x and y are in output pixels from here
+    auto& rows = Rows<T>();
+
+    {
+        StageTimer timer(DecodeStage::Idct);
+        for (size_t s = 0; s < scan_channels_.size(); ++s) {
+            if (gray_only_ &&
+                scan_channels_[s].channel_id != static_cast<size_t>(ChannelNames::Y)) {
+                continue;
+            }
+            rows[s].Inverse(columns_ * units_[s]);
+            ConvertToUnsignedScale(rows[s].Output(0),
+                                   columns_ * units_[s] * sides_[s] * sides_[s],
+                                   context_->precision);
+        }
+    }
+
+    StageTimer timer(DecodeStage::Color);
+
+    for (size_t column = 0; column < columns_; ++column) {
+        size_t y = column * (width_ / scale_);
+        if (y + width_ / scale_ <= first_column_ ||
+            y >= first_column_ + band_width_) {
+            continue;
+        }
 
-                Dequantize(context_->channels[i].qt_id);
+        for (size_t s = 0; s < scan_channels_.size(); ++s) {
+            size_t i = scan_channels_[s].channel_id;
+            if (gray_only_ && i != static_cast<size_t>(ChannelNames::Y)) {
+                continue;
+            }
 
-                idct_executor_.Inverse();
+            size_t prolong_h = context_->channels[i].vertical_thinning;
+            size_t prolong_w = context_->channels[i].horizontal_thinning;
+            size_t width_multiplier = width_ / (prolong_w * kDataUnitSide);
 
-                ConvertToUnsignedScale(context_->precision);
+            for (size_t unit = 0; unit < units_[s]; ++unit) {
+                const T* data = rows[s].Output(column * units_[s] + unit);
+                size_t j = unit / width_multiplier, k = unit % width_multiplier;
 
-                ConvertToRGB(j * kDataUnitSide, k * kDataUnitSide, i);
+                if (gray_only_) {
+                    WriteGray(data, j * side_ * prolong_h, k * side_ * prolong_w, s, x, y);
+                } else {
+                    Upsample(data, j * side_ * prolong_h, k * side_ * prolong_w, s);
+                }
             }
         }
+
+        if (!gray_only_) {
+            picture_piece_.FlushToImage(x, y, *context_, context_->Canvas());
+        }
+    }
+}
+
+template <class T>
+void MCUBlock::LoadUnits(const CoefficientStore& store, size_t x, size_t column) {
+    auto& rows = Rows<T>();
+    size_t mcu = (x / height_) * columns_ + column;
+
+    for (size_t s = 0; s < scan_channels_.size(); ++s) {
+        const ScanChannel& scan_channel = scan_channels_[s];
+        if (gray_only_ && scan_channel.channel_id != static_cast<size_t>(ChannelNames::Y)) {
+            continue;
+        }
+
+        for (size_t unit = 0; unit < units_[s]; ++unit) {
+            auto coefs = store.Block(scan_channel.channel_id, mcu * units_[s] + unit);
+            DataUnit::Dequantize(coefs.data(), coefs.size(), scan_channel,
+                                 rows[s].Input(column * units_[s] + unit), sides_[s]);
+        }
+    }
+}
+
+void MCUBlock::Load(const CoefficientStore& store, size_t x, size_t y) {
+    StageTimer timer(DecodeStage::Entropy);
+    if (exact_) {
+        LoadUnits<double>(store, x, y / width_);
+    } else {
+        LoadUnits<float>(store, x, y / width_);
+    }
+}
+
+void MCUBlock::Capture(BitReader<std::vector<uint8_t>>& reader, size_t x, size_t y) {
+    std::array<int16_t, kDataUnitSize> zigzag;
+    size_t mcu = (x / height_) * columns_ + y / width_;
+
+    for (size_t s = 0; s < scan_channels_.size(); ++s) {
+        for (size_t unit = 0; unit < units_[s]; ++unit) {
+            size_t end =
+                DataUnit::ReadQuantized(reader, scan_channels_[s], previous_dcs_[s], zigzag.data());
+            capture_->Put(scan_channels_[s].channel_id, mcu * units_[s] + unit, zigzag.data(),
+                          end);
+        }
+    }
+}
+
+void MCUBlock::Process(BitReader<std::vector<uint8_t>>& reader, size_t x, size_t y) {
+    StageTimer timer(DecodeStage::Entropy);
+    if (capture_) {
+        Capture(reader, x, y);
+    } else if (exact_) {
+        Decode<double>(reader, y / width_);
+    } else {
+        Decode<float>(reader, y / width_);
+    }
+}
+
+void MCUBlock::FlushRow(size_t x) {
+    Image& img = context_->Canvas();
+    size_t height = height_ / scale_, width = width_ / scale_;
+    x /= scale_;
+
+    if (capture_ || x + height <= first_row_ || x >= first_row_ + band_height_) {
+        damaged_.clear();
+        return;  // row is only entropy decoded to get to the requested band
+    }
+
+    TraceScope trace("reconstruct row", "row", x / height);
+    if (exact_) {
+        Reconstruct<double>(x);
+    } else {
+        Reconstruct<float>(x);
+    }
+
+    size_t begin = std::max(x, first_row_) - first_row_;
+    size_t end = std::min(x + height - first_row_, band_height_);
+
+    for (auto [column, value] : damaged_) {
+        size_t left = std::max(column * width, first_column_);
+        size_t right = std::min((column + 1) * width, first_column_ + band_width_);
+        if (left >= right) {
+            continue;
+        }
+        for (size_t i = begin; i < end; ++i) {
+            for (size_t j = left - first_column_; j < right - first_column_; ++j) {
+                auto [img_row, img_col] = context_->Place(i, j);
+                if (Image::IsGray(img.Format())) {
+                    img.SetGray(img_row, img_col, value);
+                } else {
+                    img.SetPixel(img_row, img_col, {value, value, value});
+                }
+            }
+        }
+    }
+    damaged_.clear();
+
+    if (context_->resampler) {
+        context_->resampler->PushRows(begin + first_row_ - x, end + first_row_ - x);
+    }
+}
+
+std::vector<int> MCUBlock::GetPredictors() const {
+    return previous_dcs_;
+}
+
+void MCUBlock::SetPredictors(const std::vector<int>& predictors) {
+    if (predictors.size() != previous_dcs_.size()) {
+        throw std::invalid_argument("Predictors do not match scan channels");
     }
+    previous_dcs_ = predictors;
+}
 
-    picture_piece_.FlushToImage(x, y, context_->precision, context_->image);
+void MCUBlock::ResetPredictors() {
+    std::fill(previous_dcs_.begin(), previous_dcs_.end(), 0);
+    for (auto& scan_channel : scan_channels_) {
+        scan_channel.dc_tree.Reset();
+        scan_channel.ac_tree.Reset();
+    }
 }
 
-MCUIterator::MCUIterator(std::vector<HuffmanTree>&& dc_trees, std::vector<HuffmanTree>&& ac_trees,
-                         PictureContext* context)
-    : block_(context->mcu_height, context->mcu_width, context, std::move(dc_trees),
-             std::move(ac_trees)),
-      context_(context) {
+void MCUBlock::Fill(size_t x, size_t y, int value) {
+    if (capture_) {
+        // empty blocks are stored, they are rendered with the level shift value: gray
+        size_t mcu = (x / height_) * columns_ + y / width_;
+        for (size_t s = 0; s < scan_channels_.size(); ++s) {
+            capture_->Erase(scan_channels_[s].channel_id, mcu * units_[s], units_[s]);
+        }
+        return;
+    }
+    damaged_.emplace_back(y / width_, value);
+}
+
+MCUIterator::MCUIterator(std::vector<ScanChannel>&& scan_channels, PictureContext* context)
+    : block_(context->mcu_height, context->mcu_width, context, std::move(scan_channels)),
+      context_(context),
+      row_start_(TraceNow()) {
 }
 
 MCUIterator& MCUIterator::operator++() {
     y_ += context_->mcu_width;
     if (y_ >= context_->width) {
+        RecordTraceEvent("entropy row", row_start_, "row", x_ / context_->mcu_height);
+        block_.FlushRow(x_);
         y_ = 0;
         x_ += context_->mcu_height;
+        row_start_ = TraceNow();
     }
     return *this;
 }
@@ -278,11 +582,321 @@ void MCUIterator::Process(BitReader<std::vector<uint8_t>>& reader) {
     block_.Process(reader, x_, y_);
 }
 
+void MCUIterator::Seek(size_t mcu_row) {
+    x_ = mcu_row * context_->mcu_height;
+    y_ = 0;
+    row_start_ = TraceNow();
+}
+
+void MCUIterator::Fill(int value) {
+    block_.Fill(x_, y_, value);
+}
+
+size_t MCUIterator::Row() const {
+    return x_;
+}
+
 bool MCUIterator::IsEnd() {
     return (y_ >= context_->width || x_ >= context_->height);
 }
 
-MCUIterator PictureContext::GetMCUBeginIterator(std::vector<HuffmanTree>&& dc_trees,
-                                                std::vector<HuffmanTree>&& ac_trees) {
-    return MCUIterator(std::move(dc_trees), std::move(ac_trees), this);
-}
\ No newline at end of file
+MCUIterator PictureContext::GetMCUBeginIterator(std::vector<ScanChannel>&& scan_channels) {
+    return MCUIterator(std::move(scan_channels), this);
+}
+
+ScanChannel PictureContext::PrepareScanChannel(uint8_t channel_id, uint8_t dc_id,
+                                               uint8_t ac_id) const {
+    auto it_dc = dc_huffman_trees.find(dc_id);
+    auto it_ac = ac_huffman_trees.find(ac_id);
+
+    if (it_dc == dc_huffman_trees.end()) {
+        throw std::invalid_argument("No DC Huffman tree with id: " + std::to_string(dc_id));
+    }
+
+    if (it_ac == ac_huffman_trees.end()) {
+        throw std::invalid_argument("No AC Huffman tree with id: " + std::to_string(ac_id));
+    }
+
+    uint8_t qt_id = channels[channel_id].qt_id;
+    auto it_qt = qts.find(qt_id);
+    if (it_qt == qts.end()) {
+        throw std::invalid_argument("No QT with id: " + std::to_string(qt_id));
+    }
+
+    return {channel_id, it_dc->second, it_ac->second, it_qt->second->prescaled};
+}
+
+void PictureContext::ResolveColorSpace() {
+    switch (channels.size()) {
+        case 1:
+            color_space = ColorSpace::Grayscale;
+            break;
+        case 3:
+            color_space = (adobe_transform && *adobe_transform == 0) ? ColorSpace::RGB
+                                                                     : ColorSpace::YCbCr;
+            break;
+        case 4:
+            color_space = (adobe_transform && *adobe_transform == 2) ? ColorSpace::YCCK
+                                                                     : ColorSpace::CMYK;
+            break;
+        default:
+            throw std::invalid_argument("Unsupported number of channels: " +
+                                        std::to_string(channels.size()));
+    }
+
+    DLOG(INFO) << "Color space: " << static_cast<size_t>(color_space);
+}
+
+bool PictureContext::IsGrayOnly() const {
+    return color_space == ColorSpace::Grayscale ||
+           (Image::IsGray(options.output_format) && color_space == ColorSpace::YCbCr);
+}
+
+void PictureContext::CheckImageLimits(size_t columns, size_t rows) const {
+    const DecodeLimits& limits = options.limits;
+    size_t pixels = static_cast<size_t>(width) * height;
+
+    if (limits.max_pixels && pixels > limits.max_pixels) {
+        throw LimitExceededError("Image has " + std::to_string(pixels) +
+                                 " pixels, limit is " + std::to_string(limits.max_pixels));
+    }
+
+    auto bytes = [&](size_t columns, size_t rows, PixelFormat format) {
+        return columns * rows * Image::PixelBytes(format);
+    };
+    // caller memory is not allocated by the decoder
+    size_t image_bytes = output_pixels ? 0 : bytes(columns, rows, options.output_format);
+    bool gray_strip = Image::IsGray(options.output_format);
+    image_bytes +=
+        bytes(OutputWidth(), strip_rows, gray_strip ? PixelFormat::Gray16 : PixelFormat::RGB);
+
+    size_t total = buffered_bytes + stored_bytes + image_bytes;
+    if (limits.max_memory && total > limits.max_memory) {
+        throw LimitExceededError("Decoding needs " + std::to_string(total) + " bytes, limit is " +
+                                 std::to_string(limits.max_memory));
+    }
+}
+
+PictureContext::ImageLayout PictureContext::PlanImage() const {
+    size_t scale = options.scale_denominator;
+    if (scale != 1 && scale != 2 && scale != 4 && scale != 8) {
+        throw std::invalid_argument("Scale denominator must be 1, 2, 4 or 8");
+    }
+
+    if (options.first_row >= (height + scale - 1) / scale) {
+        throw std::invalid_argument("First row is out of the picture");
+    }
+    if (options.first_column >= (width + scale - 1) / scale) {
+        throw std::invalid_argument("First column is out of the picture");
+    }
+
+    ImageLayout layout{scale, OutputHeight(), OutputWidth(), false};
+    if (!options.output_width && !options.output_height) {
+        return layout;
+    }
+
+    // target is given upright, rows and columns are in stored orientation
+    bool transposed = options.apply_orientation && orientation >= 5 && orientation <= 8;
+    size_t target_rows = transposed ? options.output_width : options.output_height;
+    size_t target_columns = transposed ? options.output_height : options.output_width;
+    if (!target_rows) {
+        target_rows =
+            std::max<size_t>(1, std::lround(1.0 * layout.rows * target_columns / layout.columns));
+    }
+    if (!target_columns) {
+        target_columns =
+            std::max<size_t>(1, std::lround(1.0 * layout.columns * target_rows / layout.rows));
+    }
+
+    // scaled IDCT takes the bulk of a large reduction, the filter only the rest
+    bool band =
+        options.first_row || options.row_count || options.first_column || options.column_count;
+    while (!band && scale < 8 && (width + 2 * scale - 1) / (2 * scale) >= target_columns &&
+           (height + 2 * scale - 1) / (2 * scale) >= target_rows) {
+        scale *= 2;
+    }
+    return {scale, target_rows, target_columns, true};
+}
+
+std::pair<size_t, size_t> PictureContext::ImageSize() const {
+    ImageLayout layout = PlanImage();
+    bool transposed = options.apply_orientation && orientation >= 5 && orientation <= 8;
+    if (transposed) {
+        return {layout.rows, layout.columns};
+    }
+    return {layout.columns, layout.rows};
+}
+
+void PictureContext::PrepareImage() {
+    PixelFormat format = options.output_format;
+    if ((format == PixelFormat::Gray8 || format == PixelFormat::RGB8) && precision != 8) {
+        throw std::invalid_argument("Gray8 and RGB8 output require 8 bit precision");
+    }
+
+    ImageLayout layout = PlanImage();
+    options.scale_denominator = layout.scale;
+    ptrdiff_t rows = layout.rows, columns = layout.columns;
+    resampler.reset();
+    strip_rows = layout.resized ? mcu_height / layout.scale : 0;
+
+    CheckImageLimits(columns, rows);
+
+    switch (options.apply_orientation ? orientation : 1) {
+        case 2:  // mirrored horizontally
+            placement = {0, 1, 0, columns - 1, 0, -1};
+            break;
+        case 3:  // rotated 180
+            placement = {rows - 1, -1, 0, columns - 1, 0, -1};
+            break;
+        case 4:  // mirrored vertically
+            placement = {rows - 1, -1, 0, 0, 0, 1};
+            break;
+        case 5:  // transposed
+            placement = {0, 0, 1, 0, 1, 0};
+            break;
+        case 6:  // stored rotated 90 counterclockwise
+            placement = {0, 0, 1, rows - 1, -1, 0};
+            break;
+        case 7:  // transversed
+            placement = {columns - 1, 0, -1, rows - 1, -1, 0};
+            break;
+        case 8:  // stored rotated 90 clockwise
+            placement = {columns - 1, 0, -1, 0, 1, 0};
+            break;
+        default:
+            placement = {};
+    }
+
+    size_t image_width = placement.row_by_column ? rows : columns;
+    size_t image_height = placement.row_by_column ? columns : rows;
+    if (output_pixels) {
+        if (options.output_format == PixelFormat::RGB) {
+            throw std::invalid_argument("Caller memory takes packed pixels, not RGB");
+        }
+        if (!Image::FitsBuffer(image_width, image_height, options.output_format, output_stride,
+                               output_size)) {
+            throw std::invalid_argument("Output buffer is too small for the image");
+        }
+        image.Wrap(output_pixels, output_stride, image_width, image_height,
+                   options.output_format);
+    } else if (options.buffer_pool) {
+        size_t stride = image_width * Image::PixelBytes(options.output_format);
+        auto buffer =
+            std::make_shared<PooledBuffer>(options.buffer_pool->Acquire(stride * image_height));
+        image.Wrap(buffer->Data(), stride, image_width, image_height, options.output_format,
+                   buffer);
+    } else {
+        image.SetSize(image_width, image_height, options.output_format);
+    }
+
+    if (strip_rows) {
+        resampler = std::make_shared<Resampler>(OutputWidth(), OutputHeight(), strip_rows, columns,
+                                                rows, options.resize_filter,
+                                                (1 << precision) - 1, &image, placement);
+    }
+}
+
+Image& PictureContext::Canvas() {
+    return resampler ? resampler->Strip() : image;
+}
+
+size_t PictureContext::OutputWidth() const {
+    size_t columns = (width + options.scale_denominator - 1) / options.scale_denominator;
+    columns -= std::min(columns, options.first_column);
+    return options.column_count ? std::min(columns, options.column_count) : columns;
+}
+
+size_t PictureContext::OutputHeight() const {
+    size_t rows = (height + options.scale_denominator - 1) / options.scale_denominator;
+    rows -= std::min(rows, options.first_row);
+    return options.row_count ? std::min(rows, options.row_count) : rows;
+}
+
+void PictureContext::CountMCU() {
+    constexpr size_t kTimeCheckPeriod = 64;  // MCUs between clock reads
+    const DecodeLimits& limits = options.limits;
+
+    size_t decoded = ++mcus_decoded;
+
+    if (limits.max_mcus && decoded > limits.max_mcus) {
+        throw LimitExceededError("MCU budget exceeded: " + std::to_string(limits.max_mcus));
+    }
+
+    if (limits.max_time.count() && decoded % kTimeCheckPeriod == 0 &&
+        std::chrono::steady_clock::now() - decode_start > limits.max_time) {
+        throw LimitExceededError("Decoding time limit exceeded: " +
+                                 std::to_string(limits.max_time.count()) + " ms");
+    }
+}
+
+void PictureContext::ChargeStore(size_t bytes) {
+    const DecodeLimits& limits = options.limits;
+
+    size_t total = buffered_bytes + (stored_bytes += bytes);
+    if (limits.max_memory && total > limits.max_memory) {
+        throw LimitExceededError("Coefficients need " + std::to_string(total) +
+                                 " bytes, limit is " + std::to_string(limits.max_memory));
+    }
+}
+
+void PictureContext::AddStatus(const DecodeStatus& result) {
+    if (!result.complete && (status.complete || result.valid_rows < status.valid_rows)) {
+        status.complete = false;
+        status.error = result.error;
+        status.valid_rows = result.valid_rows;
+    }
+    status.damaged_mcus += result.damaged_mcus;
+}
+
+void PictureContext::FinishScans() {
+    if (scan_tasks.empty()) {
+        return;  // no scan at all or a single interleaved one
+    }
+
+    for (const DecodeStatus& result : WaitAll(scan_tasks)) {
+        AddStatus(result);
+    }
+    scan_tasks.clear();
+
+    if (scanned_channels != (1 << channels.size()) - 1) {
+        if (!options.tolerant) {
+            throw std::invalid_argument("Some channels have no scan");
+        }
+        DLOG(INFO) << "Channels without scan are left gray";
+        if (status.complete) {
+            status.complete = false;
+            status.error = "Some channels have no scan";
+        }
+        status.valid_rows = 0;
+    }
+
+    if (!coefficients) {
+        scan_store->Finish(*this);
+        scan_store->RenderTo(*this);
+        scan_store.reset();
+        FinishImage();
+    }
+
+    if (status.complete) {
+        status.valid_rows = OutputHeight();
+    }
+}
+
+void PictureContext::FinishImage() {
+    if (resampler) {
+        resampler->Finish();
+        resampler.reset();
+        strip_rows = 0;
+    }
+}
+
+void PictureContext::CancelScans() {
+    for (std::future<DecodeStatus>& task : scan_tasks) {
+        // deferred scans have not started, there is nothing to wait for
+        if (task.valid() &&
+            task.wait_for(std::chrono::seconds(0)) != std::future_status::deferred) {
+            task.wait();
+        }
+    }
+    scan_tasks.clear();
+}
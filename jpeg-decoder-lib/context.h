@@ -1,51 +1,97 @@
 #pragma once
 
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <future>
+#include <memory>
+#include <optional>
 #include <unordered_map>
+#include <utility>
 
 #include "huffman.h"
 #include "bitreader.h"
 #include "fft.h"
+#include "options.h"
+#include "scan_index.h"
 #include "utils/image.h"
 
 constexpr uint8_t kDataUnitSide = 8;
+constexpr size_t kDataUnitSize = kDataUnitSide * kDataUnitSide;
+
+// natural (row-major) position of i-th coefficient in zigzag order
+constexpr std::array<uint8_t, kDataUnitSize> kZigzagOrder = {
+    0,  1,  8,  16, 9,  2,  3,  10, 17, 24, 32, 25, 18, 11, 4,  5,
+    12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13, 6,  7,  14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63};
 
 enum class ChannelNames {
     Y = 0,
     Cb = 1,
     Cr = 2,
+    K = 3,
+};
+
+enum class ColorSpace {
+    Grayscale,
+    YCbCr,
+    RGB,   // Adobe transform 0 with three channels
+    CMYK,  // Adobe (inverted) CMYK
+    YCCK,  // Adobe transform 2, YCbCr + K
 };
 
 struct Channel {
+    uint8_t id;  // component identifier from SOF0
     uint8_t horizontal_thinning;
     uint8_t vertical_thinning;
     uint8_t qt_id;  // quantization table id
 };
 
+class PictureContext;
+
 struct RGBBlock {
-    RGBBlock(size_t height, size_t width)
-        : r(height, std::vector<double>(width, 0)),
-          g(height, std::vector<double>(width, 0)),
-          b(height, std::vector<double>(width, 0)) {
+    /*
+            Upsampled channel planes of one MCU, converted to output colors on flush.
+    */
+    RGBBlock(size_t channels, size_t height, size_t width)
+        : height(height), width(width), planes(channels, std::vector<double>(height * width, 0)) {
     }
 
-    void Clear();
-    void FlushToImage(size_t y, size_t x, size_t precision, Image& img);
+    // Writes block with top-left point y, x of the picture to the image of |context|,
+    // block pixels outside of the decoded band are dropped.
+    void FlushToImage(size_t y, size_t x, const PictureContext& context, Image& img);
 
-    std::vector<std::vector<double>> r, g, b;
+    double& Get(size_t channel, size_t i, size_t j) {
+        return planes[channel][i * width + j];
+    }
+
+    size_t height;
+    size_t width;
+    std::vector<std::vector<double>> planes;  // indexed by channel, row-major
 };
 
-class DiagonalUnitIterator {
-public:
-    void Proceed();
-    bool IsEnd();
+struct QuantTable {
+    /*
+            Quantization table as it is in DQT and its copy prescaled for IDCT.
+            Built once per distinct table, see TableCache.
+    */
+    explicit QuantTable(const std::array<uint16_t, kDataUnitSize>& values);
 
-    std::pair<size_t, size_t> Get() const {
-        return {x_, y_};
-    }
+    std::array<uint16_t, kDataUnitSize> values;   // natural order
+    std::array<double, kDataUnitSize> prescaled;  // natural order, multiplied by DctInputScale
+};
 
-private:
-    size_t x_ = 0;
-    size_t y_ = 0;
+struct ScanChannel {
+    /*
+            Tables of one scan channel, resolved once per scan
+            instead of looking them up for every data unit.
+    */
+    uint8_t channel_id;  // index in PictureContext::channels
+    HuffmanTree dc_tree;
+    HuffmanTree ac_tree;
+    std::array<double, kDataUnitSize> qt;  // natural order, prescaled for IDCT
 };
 
 class DataUnit {
@@ -53,71 +99,113 @@ class DataUnit {
             8x8 block for some channel
     */
 public:
-    friend class MCUBlock;
-
-    DataUnit() : block_(kDataUnitSide * kDataUnitSide) {
-    }
-
-    void Read(BitReader<std::vector<uint8_t>>& reader, HuffmanTree dc_tree, HuffmanTree ac_tree);
-
-    class Iterator {  // for traversing diagonally
-    public:
-        Iterator(std::vector<double>* block) : block_(block) {
-        }
-
-        Iterator& operator++();
-        double& operator*();
-
-        bool IsEnd();
-
-    private:
-        DiagonalUnitIterator gut_it_;
-        std::vector<double>* block_;
-    };
-
-    double& Get(size_t i, size_t j) {
-        return block_[i * kDataUnitSide + j];
-    }
-
-    const double& Get(size_t i, size_t j) const {
-        return block_[i * kDataUnitSide + j];
-    }
+    // Decodes unit, dequantizes coefficients and places them in natural order to |block|.
+    // prev_dc is the quantized DC of the previous unit of this channel.
+    // Only top-left side by side coefficients are kept for scaled IDCT.
+    template <class T>
+    static void Read(BitReader<std::vector<uint8_t>>& reader, ScanChannel& channel, int& prev_dc,
+                     T* block, size_t side = kDataUnitSide);
+
+    // Decodes unit without dequantization, |zigzag| receives coefficients in zigzag order.
+    // Returns end of block: position after the last nonzero coefficient.
+    static size_t ReadQuantized(BitReader<std::vector<uint8_t>>& reader, ScanChannel& channel,
+                                int& prev_dc, int16_t* zigzag);
+
+    // Second half of Read for coefficients stored by ReadQuantized.
+    template <class T>
+    static void Dequantize(const int16_t* zigzag, size_t end, const ScanChannel& channel,
+                           T* block, size_t side = kDataUnitSide);
 
 private:
-    std::vector<double> block_;  // this is square matrix
+    // Huffman decodes unit, passing zigzag index and value of every coded coefficient to |sink|.
+    template <class Sink>
+    static void Decode(BitReader<std::vector<uint8_t>>& reader, ScanChannel& channel,
+                       int& prev_dc, Sink&& sink);
 };
 
-class PictureContext;
+class CoefficientStore;
+class Resampler;
 
 class MCUBlock {
     /*
             Minimum coded unit consists of DataUnit objects for each channel.
             MCU can contain several DataUnit objects for some channel.
+            Units of a whole MCU row are kept per channel one after another, so
+            the row is transformed with few batched IDCT calls when it is complete.
     */
 public:
     MCUBlock(size_t height, size_t width, PictureContext* context,
-             std::vector<HuffmanTree>&& dc_trees, std::vector<HuffmanTree>&& ac_trees);
+             std::vector<ScanChannel>&& scan_channels);
 
+    // Entropy decodes MCU with top-left point x, y into the row buffers.
     void Process(BitReader<std::vector<uint8_t>>& reader, size_t x, size_t y);
 
+    // Fills the row buffers like Process, from coefficients of the store.
+    void Load(const CoefficientStore& store, size_t x, size_t y);
+
+    // Transforms and converts MCUs of the row starting at picture row x, writes them to image.
+    void FlushRow(size_t x);
+
+    // Restart interval boundary: DC predictions start from zero again.
+    void ResetPredictors();
+
+    // DC predictions of scan channels, saved and restored by scan index checkpoints.
+    std::vector<int> GetPredictors() const;
+    void SetPredictors(const std::vector<int>& predictors);
+
+    // Fills MCU area of the image with |value| once its row is flushed,
+    // used for damaged MCUs in tolerant mode.
+    void Fill(size_t x, size_t y, int value);
+
     size_t GetHeight() const;
     size_t GetWidth() const;
 
 private:
-    void Dequantize(size_t qt_id);  // inverse quantization
-    void ConvertToUnsignedScale(size_t precision);
-    void ConvertToRGB(size_t x, size_t y, size_t channel_id);
+    template <class T>
+    std::vector<DctCalculator<T>>& Rows();
+
+    template <class T>
+    void Decode(BitReader<std::vector<uint8_t>>& reader, size_t column);
+
+    template <class T>
+    void LoadUnits(const CoefficientStore& store, size_t x, size_t column);
+
+    // Stores quantized coefficients instead of decoding into the row buffers.
+    void Capture(BitReader<std::vector<uint8_t>>& reader, size_t x, size_t y);
+
+    template <class T>
+    void Reconstruct(size_t x);
+
+    template <class T>
+    void ConvertToUnsignedScale(T* data, size_t count, size_t precision);
+
+    template <class T>
+    void Upsample(const T* unit, size_t x, size_t y, size_t s);
+
+    template <class T>
+    void WriteGray(const T* unit, size_t x, size_t y, size_t s, size_t img_y, size_t img_x);
 
 private:
     size_t height_;
     size_t width_;
-    std::vector<double> previous_dcs_;
-    DataUnit unit_before_idct_;  // we do not store all units, we only need one unit at each moment
-    DataUnit unit_after_idct_;
+    size_t columns_;    // MCUs in a row
+    size_t scale_;      // output is scale_ times smaller than coded picture
+    size_t side_;       // side of reconstructed data unit
+    size_t first_row_;  // output row stored as image row 0, rows above are not reconstructed
+    size_t first_column_;
+    size_t band_height_;  // output rows and columns of the band
+    size_t band_width_;
+    std::vector<ScanChannel> scan_channels_;  // in scan order
+    bool gray_only_;                          // only the first channel is reconstructed
+    bool exact_;                              // double precision IDCT
+    std::vector<int> previous_dcs_;
+    std::vector<size_t> units_;  // data units per MCU of each scan channel
+    std::vector<size_t> sides_;  // reconstructed unit side of each scan channel
+    std::vector<DctCalculator<float>> float_rows_;  // per scan channel, one is used
+    std::vector<DctCalculator<double>> double_rows_;
+    std::vector<std::pair<size_t, int>> damaged_;  // MCU column and fill value
+    CoefficientStore* capture_;  // receives coefficients, nothing is reconstructed then
     PictureContext* context_;
-    std::vector<HuffmanTree> dc_trees_;
-    std::vector<HuffmanTree> ac_trees_;
-    DctCalculator idct_executor_;
     RGBBlock picture_piece_;
 };
 
@@ -128,14 +216,22 @@ class MCUIterator {
                                     - flush it to the Image object.
     */
 public:
-    MCUIterator(std::vector<HuffmanTree>&& dc_trees, std::vector<HuffmanTree>&& ac_trees,
-                PictureContext* context);
+    MCUIterator(std::vector<ScanChannel>&& scan_channels, PictureContext* context);
 
+    // Moving past the last MCU of a row flushes the row to the image.
     MCUIterator& operator++();
     MCUBlock* operator->();
 
     void Process(BitReader<std::vector<uint8_t>>& reader);
 
+    void Fill(int value);
+
+    // Moves to the first MCU of the row.
+    void Seek(size_t mcu_row);
+
+    // Top picture row covered by current MCU.
+    size_t Row() const;
+
     bool IsEnd();
 
 private:
@@ -143,22 +239,140 @@ private:
     size_t y_ = 0;
     MCUBlock block_;
     PictureContext* context_;
+    uint64_t row_start_;  // TraceNow when the row began
+};
+
+struct Placement {
+    /*
+            Maps band pixel (row, column) to its image position for EXIF orientation:
+            image row = row0 + row * row_by_row + column * row_by_column, likewise for columns.
+    */
+    ptrdiff_t row0 = 0;
+    ptrdiff_t row_by_row = 1;
+    ptrdiff_t row_by_column = 0;
+    ptrdiff_t column0 = 0;
+    ptrdiff_t column_by_row = 0;
+    ptrdiff_t column_by_column = 1;
 };
 
 class PictureContext {
 public:
-    MCUIterator GetMCUBeginIterator(std::vector<HuffmanTree>&& dc_trees,
-                                    std::vector<HuffmanTree>&& ac_trees);
+    MCUIterator GetMCUBeginIterator(std::vector<ScanChannel>&& scan_channels);
+
+    // Per-scan setup: resolves Huffman trees and quantization table of the channel.
+    ScanChannel PrepareScanChannel(uint8_t channel_id, uint8_t dc_id, uint8_t ac_id) const;
+
+    // Picks color space from channel count and Adobe transform flag,
+    // must be called after all header sections are processed.
+    void ResolveColorSpace();
+
+    // Whether only luma has to be reconstructed for requested output.
+    bool IsGrayOnly() const;
+
+    // Checks pixel and memory limits for a |columns| x |rows| image and the resize strip,
+    // must be called before they are allocated.
+    void CheckImageLimits(size_t columns, size_t rows) const;
+
+    // Validates scale and band options against the picture, checks limits
+    // and allocates the image, or wraps output_pixels if they are set.
+    void PrepareImage();
+
+    // Upright width and height of the image PrepareImage would make, after scaling,
+    // band selection, resizing and orientation. Needs only the header sections.
+    std::pair<size_t, size_t> ImageSize() const;
+
+    // Size of decoded image, smaller than the picture for scaled and band decoding.
+    size_t OutputWidth() const;
+    size_t OutputHeight() const;
+
+    // Image band pixels are written to: the image itself or, when resizing, the strip.
+    Image& Canvas();
+
+    // Canvas row and column of band pixel |row|, |column|, see Placement.
+    std::pair<size_t, size_t> Place(size_t row, size_t column) const {
+        if (strip_rows) {
+            return {(row + options.first_row) % strip_rows, column};  // MCU rows are aligned
+        }
+        return {row * placement.row_by_row + column * placement.row_by_column + placement.row0,
+                row * placement.column_by_row + column * placement.column_by_column +
+                    placement.column0};
+    }
+
+private:
+    struct ImageLayout {
+        size_t scale;  // scale_denominator, a resize may pick a larger one
+        size_t rows;   // of the image in stored orientation
+        size_t columns;
+        bool resized;
+    };
+
+    // Validates options and computes the image PrepareImage makes.
+    ImageLayout PlanImage() const;
+
+public:
+    // Accounts one decoded MCU against MCU and time budget.
+    void CountMCU();
+
+    // Accounts |bytes| more of coefficients collected from scans against the memory limit,
+    // must be called before they are allocated.
+    void ChargeStore(size_t bytes);
+
+    // Merges outcome of a scan band or a non-interleaved scan into status.
+    void AddStatus(const DecodeStatus& result);
+
+    // Waits for non-interleaved scans, then renders their coefficients, unless they are
+    // captured for CoefficientStore::Read. Must be called after the last scan is processed.
+    void FinishScans();
+
+    // Waits for non-interleaved scans already running, when processing is abandoned.
+    void CancelScans();
+
+    // Completes the resized image after the last band row, rows a damaged scan
+    // did not deliver are black.
+    void FinishImage();
 
 public:
+    DecodeOptions options;
+    std::chrono::steady_clock::time_point decode_start = std::chrono::steady_clock::now();
+    size_t buffered_bytes = 0;  // sections kept by MarkerController
+    std::atomic<size_t> mcus_decoded = 0;  // scan bands may be decoded concurrently
+    std::atomic<size_t> stored_bytes = 0;  // of CoefficientStore, scans may fill it concurrently
+    DecodeStatus status;
     Image image;
-    uint8_t precision;
-    uint16_t height;
-    uint16_t width;
-    uint8_t mcu_height;
-    uint8_t mcu_width;
-    std::vector<Channel> channels;
+    // Caller memory of |output_size| bytes the image is decoded into, rows |output_stride|
+    // bytes apart, see Decoder::DecodeInto. Gray8 and RGB8 only.
+    uint8_t* output_pixels = nullptr;
+    size_t output_size = 0;
+    size_t output_stride = 0;
+    uint8_t precision = 0;
+    uint16_t height = 0;
+    uint16_t width = 0;
+    uint8_t mcu_height = 0;
+    uint8_t mcu_width = 0;
+    std::vector<Channel> channels;  // in SOF0 order
+    ColorSpace color_space = ColorSpace::YCbCr;
+    std::optional<uint8_t> adobe_transform;  // from APP14 Adobe marker
+    uint16_t restart_interval = 0;           // in MCUs, zero if there are no restarts
+    // scan data offsets following RSTn markers, one list per scan, shared by decoders of
+    // the same separated sections
+    std::shared_ptr<std::vector<std::vector<size_t>>> restart_positions =
+        std::make_shared<std::vector<std::vector<size_t>>>();
+    size_t scans = 0;                       // SOS sections processed
+    uint8_t scanned_channels = 0;           // bit per channel met in scans so far
     std::unordered_map<uint8_t, HuffmanTree> ac_huffman_trees;
     std::unordered_map<uint8_t, HuffmanTree> dc_huffman_trees;
-    std::unordered_map<uint8_t, std::vector<uint16_t>> qts;  // quantization tables
+    std::unordered_map<uint8_t, std::shared_ptr<const QuantTable>> qts;  // quantization tables
+    std::vector<uint8_t> thumbnail;  // embedded JPEG preview from EXIF or JFXX
+    uint16_t orientation = 1;        // from EXIF, used with apply_orientation
+    Placement placement;             // set by PrepareImage
+    // Set by PrepareImage for output_width and output_height: band rows are written
+    // to its strip of |strip_rows| rows, one MCU row, and resampled to |image|.
+    std::shared_ptr<Resampler> resampler;
+    size_t strip_rows = 0;
+    std::shared_ptr<const ScanIndex> scan_index;  // recorded by full decode, see index_rows
+    CoefficientStore* coefficients = nullptr;     // set by CoefficientStore::Read, no image then
+    // Non-interleaved scans are entropy decoded to |coefficients| or |scan_store|,
+    // concurrently with a pool, and reconstructed together by FinishScans.
+    std::shared_ptr<CoefficientStore> scan_store;
+    std::vector<std::future<DecodeStatus>> scan_tasks;
 };
\ No newline at end of file
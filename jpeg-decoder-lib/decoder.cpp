@@ -1,12 +1,97 @@
 #include "decoder.h"
 
-Image Decode(std::istream& input) {
-    Decoder decoder(input);
+#include <glog/logging.h>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <utility>
+
+#include "trace.h"
+
+Image Decode(std::istream& input, const DecodeOptions& options) {
+    Decoder decoder(input, options);
 
     return decoder.Decode();
 }
 
 Image Decoder::Decode() {
+    TraceScope trace("decode");
+    context_.decode_start = std::chrono::steady_clock::now();
+    controller_.SeparateAndProcess();
+    return std::move(context_.image);
+}
+
+void Decoder::DecodeInto(uint8_t* pixels, size_t size, size_t stride) {
+    if (!pixels) {
+        throw std::invalid_argument("No output buffer");
+    }
+    context_.output_pixels = pixels;
+    context_.output_size = size;
+    context_.output_stride = stride;
+    TraceScope trace("decode");
+    context_.decode_start = std::chrono::steady_clock::now();
+    controller_.SeparateAndProcess();
+}
+
+const DecodeStatus& Decoder::GetStatus() const {
+    return context_.status;
+}
+
+std::shared_ptr<const ScanIndex> Decoder::GetScanIndex() const {
+    return context_.scan_index;
+}
+
+PictureInfo Decoder::Probe() {
+    controller_.SeparateHeaders();
+    controller_.ProcessHeaders();
+
+    if (context_.channels.empty()) {
+        throw std::invalid_argument("No SOF0 section before the scan");
+    }
+    context_.ResolveColorSpace();
+
+    PictureInfo info;
+    info.width = context_.width;
+    info.height = context_.height;
+    info.channels = context_.channels.size();
+    info.color_space = context_.color_space;
+    info.precision = context_.precision;
+    info.orientation = context_.orientation;
+    info.has_thumbnail = !context_.thumbnail.empty();
+    std::tie(info.output_width, info.output_height) = context_.ImageSize();
+    return info;
+}
+
+std::optional<std::vector<uint8_t>> Decoder::ReadThumbnail() {
+    controller_.SeparateHeaders();
+    controller_.ProcessHeaders();
+
+    if (context_.thumbnail.empty()) {
+        return std::nullopt;
+    }
+    return context_.thumbnail;
+}
+
+Image Decoder::DecodeThumbnail() {
+    constexpr size_t kFallbackScale = 8;
+
+    context_.decode_start = std::chrono::steady_clock::now();
+
+    if (auto thumbnail = ReadThumbnail()) {
+        std::istringstream input(std::string(thumbnail->begin(), thumbnail->end()));
+        try {
+            Decoder decoder(input, context_.options);
+            decoder.context_.orientation = context_.orientation;  // stored like the picture
+            return decoder.Decode();
+        } catch (const LimitExceededError&) {
+            throw;
+        } catch (const std::exception& e) {
+            DLOG(INFO) << "Embedded thumbnail is broken: " << e.what();
+        }
+    }
+
+    context_.options.scale_denominator = kFallbackScale;
     controller_.SeparateAndProcess();
-    return context_.image;
+    return std::move(context_.image);
 }
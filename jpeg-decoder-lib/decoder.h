@@ -2,19 +2,66 @@
 
 #include "utils/image.h"
 #include "context.h"
+#include "options.h"
 #include "marker_controller.h"
 
 #include <istream>
+#include <optional>
+#include <vector>
 
-Image Decode(std::istream& input);
+Image Decode(std::istream& input, const DecodeOptions& options = {});
+
+struct PictureInfo {
+    size_t width = 0;  // as stored, before scaling and orientation
+    size_t height = 0;
+    size_t channels = 0;
+    ColorSpace color_space = ColorSpace::YCbCr;
+    uint8_t precision = 0;
+    uint16_t orientation = 1;  // EXIF tag, 1 when there is none
+    bool has_thumbnail = false;
+    size_t output_width = 0;  // of the image Decode returns with the decoder options
+    size_t output_height = 0;
+};
 
 class Decoder {
 public:
-    Decoder(std::istream& input) : controller_(&input, &context_) {
+    Decoder(std::istream& input, const DecodeOptions& options = {})
+        : controller_(&input, &context_) {
+        context_.options = options;
+    }
+
+    // Decodes sections of MarkerController::Share, which may be shared by many decoders.
+    Decoder(std::shared_ptr<const SeparatedSections> separated, const DecodeOptions& options = {})
+        : controller_(std::move(separated), &context_) {
+        context_.options = options;
     }
 
     Image Decode();
 
+    // Decodes into caller memory of |size| bytes, rows |stride| bytes apart, in the Gray8 or
+    // RGB8 output_format of the options; PictureInfo::output_width and output_height tell
+    // the image size. Throws std::invalid_argument if the image does not fit.
+    void DecodeInto(uint8_t* pixels, size_t size, size_t stride);
+
+    // Parameters of the picture from sections preceding the scan, like ReadThumbnail.
+    PictureInfo Probe();
+
+    // Embedded JPEG preview from EXIF or JFIF extension. Reads only sections preceding
+    // the scan, so the picture can still be decoded afterwards.
+    std::optional<std::vector<uint8_t>> ReadThumbnail();
+
+    // Embedded preview decoded with the same options or, if there is no usable one,
+    // the picture decoded at 1/8 scale.
+    Image DecodeThumbnail();
+
+    // Outcome of the last Decode, meaningful for tolerant mode.
+    const DecodeStatus& GetStatus() const;
+
+    // Index recorded by the last complete Decode with DecodeOptions::index_rows set, up to
+    // the bottom of the decoded band; nullptr otherwise. Pass it in DecodeOptions::scan_index
+    // to decode bands of the picture.
+    std::shared_ptr<const ScanIndex> GetScanIndex() const;
+
 private:
     PictureContext context_;
     MarkerController controller_;
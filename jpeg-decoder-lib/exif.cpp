@@ -0,0 +1,104 @@
+#include "exif.h"
+
+#include <stdexcept>
+#include <string>
+
+namespace {
+
+class TiffReader {
+    /*
+            Bounds checked reads of TIFF values in file byte order.
+    */
+public:
+    explicit TiffReader(const std::vector<uint8_t>& data) : data_(data) {
+        if (data.size() < 8) {
+            throw std::invalid_argument("EXIF data is too short");
+        }
+
+        if (data[0] == 'I' && data[1] == 'I') {
+            little_endian_ = true;
+        } else if (data[0] != 'M' || data[1] != 'M') {
+            throw std::invalid_argument("Unknown TIFF byte order");
+        }
+
+        if (Read16(2) != 42) {
+            throw std::invalid_argument("No TIFF magic number");
+        }
+    }
+
+    uint16_t Read16(size_t offset) const {
+        Check(offset, 2);
+        return little_endian_ ? data_[offset] | (data_[offset + 1] << 8)
+                              : (data_[offset] << 8) | data_[offset + 1];
+    }
+
+    uint32_t Read32(size_t offset) const {
+        uint32_t first = Read16(offset), second = Read16(offset + 2);
+        return little_endian_ ? first | (second << 16) : (first << 16) | second;
+    }
+
+    void Check(size_t offset, size_t size) const {
+        if (offset > data_.size() || size > data_.size() - offset) {
+            throw std::invalid_argument("EXIF offset is out of data: " + std::to_string(offset));
+        }
+    }
+
+private:
+    const std::vector<uint8_t>& data_;
+    bool little_endian_ = false;
+};
+
+constexpr size_t kEntrySize = 12;  // tag, type, count, value or offset
+constexpr uint16_t kTagOrientation = 0x0112;
+constexpr uint16_t kTagThumbnailOffset = 0x0201;
+constexpr uint16_t kTagThumbnailSize = 0x0202;
+
+}  // namespace
+
+ExifInfo ParseExif(const std::vector<uint8_t>& tiff) {
+    TiffReader reader(tiff);
+    ExifInfo result;
+
+    size_t ifd0 = reader.Read32(4);
+    size_t ifd0_entries = reader.Read16(ifd0);
+    for (size_t i = 0; i < ifd0_entries; ++i) {
+        size_t entry = ifd0 + 2 + i * kEntrySize;
+        if (reader.Read16(entry) == kTagOrientation) {
+            uint16_t orientation = reader.Read16(entry + 8);  // SHORT value is inline
+            if (orientation >= 1 && orientation <= 8) {
+                result.orientation = orientation;
+            }
+        }
+    }
+
+    size_t ifd1 = reader.Read32(ifd0 + 2 + ifd0_entries * kEntrySize);
+
+    if (ifd1 == 0) {
+        return result;  // no second image
+    }
+    if (ifd1 == ifd0) {
+        throw std::invalid_argument("EXIF IFD chain loops");
+    }
+
+    std::optional<size_t> offset;
+    size_t size = 0;
+
+    size_t ifd1_entries = reader.Read16(ifd1);
+    for (size_t i = 0; i < ifd1_entries; ++i) {
+        size_t entry = ifd1 + 2 + i * kEntrySize;
+        uint16_t tag = reader.Read16(entry);
+        if (tag == kTagThumbnailOffset) {
+            offset = reader.Read32(entry + 8);
+        } else if (tag == kTagThumbnailSize) {
+            size = reader.Read32(entry + 8);
+        }
+    }
+
+    if (offset && size) {
+        reader.Check(*offset, size);
+        result.thumbnail_offset = offset;
+        result.thumbnail_size = size;
+    }
+
+    return result;
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+struct ExifInfo {
+    // Location of JPEG preview (IFD1 JPEGInterchangeFormat) in the TIFF data.
+    std::optional<size_t> thumbnail_offset;
+    size_t thumbnail_size = 0;
+    // IFD0 Orientation: 1 is upright, 2..8 are flips and rotations of stored picture.
+    uint16_t orientation = 1;
+};
+
+// Parses TIFF structure of EXIF APP1 payload, |tiff| starts after "Exif\0\0".
+// Throws std::invalid_argument on malformed data.
+ExifInfo ParseExif(const std::vector<uint8_t>& tiff);
@@ -5,46 +5,183 @@
 #include <fftw3.h>
 #include <stdexcept>
 
-DctCalculator::DctCalculator(size_t width, std::vector<double> *input, std::vector<double> *output)
-    : input_(input), output_(output), width_(width) {
-    if (!input || !output) {
-        throw std::invalid_argument("No input or output given for IDCT");
+namespace {
+
+template <class PlanFunction, class T>
+auto PlanManyR2R(PlanFunction plan_function, size_t width, size_t blocks, T* input, T* output,
+                 unsigned flags) {
+    int size = width * width;
+    int dims[] = {static_cast<int>(width), static_cast<int>(width)};
+    fftw_r2r_kind kinds[] = {FFTW_REDFT01, FFTW_REDFT01};
+
+    return plan_function(2, dims, blocks, input, nullptr, 1, size, output, nullptr, 1, size,
+                         kinds, flags);
+}
+
+}  // namespace
+
+FftwTraits<double>::Plan FftwTraits<double>::PlanMany(size_t width, size_t blocks, double* input,
+                                                      double* output, unsigned flags) {
+    return PlanManyR2R(fftw_plan_many_r2r, width, blocks, input, output, flags);
+}
+
+void FftwTraits<double>::Execute(Plan plan, double* input, double* output) {
+    fftw_execute_r2r(plan, input, output);
+}
+
+void FftwTraits<double>::Destroy(Plan plan) {
+    fftw_destroy_plan(plan);
+}
+
+bool FftwTraits<double>::ImportWisdom(const std::string& path) {
+    return fftw_import_wisdom_from_filename(path.c_str());
+}
+
+bool FftwTraits<double>::ExportWisdom(const std::string& path) {
+    return fftw_export_wisdom_to_filename(path.c_str());
+}
+
+FftwTraits<float>::Plan FftwTraits<float>::PlanMany(size_t width, size_t blocks, float* input,
+                                                    float* output, unsigned flags) {
+    return PlanManyR2R(fftwf_plan_many_r2r, width, blocks, input, output, flags);
+}
+
+void FftwTraits<float>::Execute(Plan plan, float* input, float* output) {
+    fftwf_execute_r2r(plan, input, output);
+}
+
+void FftwTraits<float>::Destroy(Plan plan) {
+    fftwf_destroy_plan(plan);
+}
+
+bool FftwTraits<float>::ImportWisdom(const std::string& path) {
+    return fftwf_import_wisdom_from_filename(path.c_str());
+}
+
+bool FftwTraits<float>::ExportWisdom(const std::string& path) {
+    return fftwf_export_wisdom_to_filename(path.c_str());
+}
+
+DctPlanRegistry& DctPlanRegistry::Instance() {
+    static DctPlanRegistry registry;
+    return registry;
+}
+
+template <>
+std::map<std::pair<size_t, size_t>, fftw_plan>& DctPlanRegistry::Plans<double>() {
+    return double_plans_;
+}
+
+template <>
+std::map<std::pair<size_t, size_t>, fftwf_plan>& DctPlanRegistry::Plans<float>() {
+    return float_plans_;
+}
+
+template <class T>
+typename FftwTraits<T>::Plan DctPlanRegistry::Get(size_t width, size_t blocks) {
+    std::lock_guard lock(mutex_);
+
+    auto& plans = Plans<T>();
+    auto it = plans.find({width, blocks});
+    if (it != plans.end()) {
+        return it->second;
     }
 
-    if (input->size() % width != 0 || input->size() / width != width) {  // avoiding overflow
-        throw std::invalid_argument("Input array is not WIDTHxWIDTH");
+    unsigned flags = FFTW_DESTROY_INPUT;
+    switch (rigor_) {
+        case PlanRigor::Estimate:
+            flags |= FFTW_ESTIMATE;
+            break;
+        case PlanRigor::Measure:
+            flags |= FFTW_MEASURE;
+            break;
+        case PlanRigor::Patient:
+            flags |= FFTW_PATIENT;
+            break;
     }
 
-    if (output->size() % width != 0 || output->size() / width != width) {
-        throw std::invalid_argument("Output array is not WIDTHxWIDTH");
+    DLOG(INFO) << "Planning IDCT of " << blocks << " blocks " << width << "x" << width
+               << ", element size " << sizeof(T);
+
+    // measuring planners overwrite arrays, so plan on scratch buffers
+    DctBuffer<T> input(width * width * blocks), output(width * width * blocks);
+    auto plan = FftwTraits<T>::PlanMany(width, blocks, input.data(), output.data(), flags);
+    if (!plan) {
+        throw std::runtime_error("FFTW failed to create IDCT plan");
     }
 
-    plan_ = fftw_plan_r2r_2d(width, width, input->data(), output->data(), FFTW_REDFT01,
-                             FFTW_REDFT01, FFTW_ESTIMATE | FFTW_DESTROY_INPUT);
+    plans.emplace(std::make_pair(width, blocks), plan);
+    return plan;
 }
 
-DctCalculator::~DctCalculator() {
-    fftw_destroy_plan(plan_);
+template FftwTraits<double>::Plan DctPlanRegistry::Get<double>(size_t width, size_t blocks);
+template FftwTraits<float>::Plan DctPlanRegistry::Get<float>(size_t width, size_t blocks);
+
+void DctPlanRegistry::SetRigor(PlanRigor rigor) {
+    std::lock_guard lock(mutex_);
+    rigor_ = rigor;
 }
 
-#include <iostream>
+bool DctPlanRegistry::ImportWisdom(const std::string& path) {
+    std::lock_guard lock(mutex_);
+    bool imported = FftwTraits<double>::ImportWisdom(path);
+    return FftwTraits<float>::ImportWisdom(path + ".float") && imported;
+}
 
-void DctCalculator::Inverse() {
-    // DLOG(INFO) << "Calculating IDCT";
+bool DctPlanRegistry::ExportWisdom(const std::string& path) {
+    std::lock_guard lock(mutex_);
+    bool exported = FftwTraits<double>::ExportWisdom(path);
+    return FftwTraits<float>::ExportWisdom(path + ".float") && exported;
+}
 
-    (*input_)[0] *= 2.0;
+DctPlanRegistry::~DctPlanRegistry() {
+    for (auto& [key, plan] : double_plans_) {
+        FftwTraits<double>::Destroy(plan);
+    }
+    for (auto& [key, plan] : float_plans_) {
+        FftwTraits<float>::Destroy(plan);
+    }
+}
 
+double DctInputScale(size_t i, size_t j) {
     double sqrt_2 = sqrt(2.0);
-    for (size_t i = 1; i < width_; ++i) {
-        (*input_)[i] *= sqrt_2;
-        (*input_)[i * width_] *= sqrt_2;
+    return (i == 0 ? sqrt_2 : 1.0) * (j == 0 ? sqrt_2 : 1.0) / 16.0;
+}
+
+template <class T>
+DctCalculator<T>::DctCalculator(size_t width, size_t blocks)
+    : width_(width), input_(width * width * blocks), output_(width * width * blocks) {
+    if (width == 0) {
+        throw std::invalid_argument("IDCT block width must be positive");
     }
+}
 
-    fftw_execute(plan_);
+template <class T>
+void DctCalculator<T>::Inverse(size_t blocks) {
+    if (blocks * width_ * width_ > input_.size()) {
+        throw std::invalid_argument("IDCT batch is larger than its buffers");
+    }
 
-    double inverse_16 = 1.0 / 16.0;
+    size_t size = width_ * width_;
+    size_t start = 0;
 
-    for (auto &val : *output_) {
-        val *= inverse_16;
+    for (; start + kMaxBatch <= blocks; start += kMaxBatch) {
+        if (!batch_plan_) {
+            batch_plan_ = DctPlanRegistry::Instance().Get<T>(width_, kMaxBatch);
+        }
+        FftwTraits<T>::Execute(batch_plan_, input_.data() + start * size,
+                               output_.data() + start * size);
+    }
+
+    if (start < blocks) {
+        if (remainder_ != blocks - start) {
+            remainder_ = blocks - start;
+            remainder_plan_ = DctPlanRegistry::Instance().Get<T>(width_, remainder_);
+        }
+        FftwTraits<T>::Execute(remainder_plan_, input_.data() + start * size,
+                               output_.data() + start * size);
     }
 }
+
+template class DctCalculator<double>;
+template class DctCalculator<float>;
@@ -4,22 +4,152 @@
 
 #include <cmath>
 #include <cstddef>
+#include <map>
+#include <mutex>
+#include <new>
 #include <optional>
+#include <string>
+#include <utility>
 #include <vector>
 
+// Allocates with fftw_malloc, so buffers have the alignment plans are created with.
+template <class T>
+struct FftwAllocator {
+    using value_type = T;
+
+    FftwAllocator() = default;
+    template <class U>
+    FftwAllocator(const FftwAllocator<U>&) {
+    }
+
+    T* allocate(size_t n) {
+        void* ptr = fftw_malloc(n * sizeof(T));
+        if (!ptr) {
+            throw std::bad_alloc();
+        }
+        return static_cast<T*>(ptr);
+    }
+
+    void deallocate(T* ptr, size_t) {
+        fftw_free(ptr);
+    }
+
+    template <class U>
+    bool operator==(const FftwAllocator<U>&) const {
+        return true;
+    }
+};
+
+template <class T>
+using DctBuffer = std::vector<T, FftwAllocator<T>>;
+
+// Double (fftw_) and single precision (fftwf_) FFTW interfaces under common names.
+template <class T>
+struct FftwTraits;
+
+template <>
+struct FftwTraits<double> {
+    using Plan = fftw_plan;
+
+    static Plan PlanMany(size_t width, size_t blocks, double* input, double* output,
+                         unsigned flags);
+    static void Execute(Plan plan, double* input, double* output);
+    static void Destroy(Plan plan);
+    static bool ImportWisdom(const std::string& path);
+    static bool ExportWisdom(const std::string& path);
+};
+
+template <>
+struct FftwTraits<float> {
+    using Plan = fftwf_plan;
+
+    static Plan PlanMany(size_t width, size_t blocks, float* input, float* output,
+                         unsigned flags);
+    static void Execute(Plan plan, float* input, float* output);
+    static void Destroy(Plan plan);
+    static bool ImportWisdom(const std::string& path);
+    static bool ExportWisdom(const std::string& path);
+};
+
+enum class PlanRigor {
+    Estimate,  // no planning cost, default
+    Measure,   // times candidate algorithms once per process or wisdom file
+    Patient,
+};
+
+class DctPlanRegistry {
+    /*
+            Process-wide inverse DCT plans. FFTW planner is not thread-safe, so plans
+            are created once under the lock and then executed on any thread with
+            fftw_execute_r2r, which is thread-safe.
+    */
+public:
+    static DctPlanRegistry& Instance();
+
+    // Plan transforming |blocks| consecutive width by width blocks on FFTW-aligned buffers.
+    template <class T>
+    typename FftwTraits<T>::Plan Get(size_t width, size_t blocks);
+
+    // Affects only plans created afterwards, so call it before the first decode.
+    void SetRigor(PlanRigor rigor);
+
+    // Wisdom makes Measure and Patient plans cheap on later process starts.
+    // Double precision wisdom is kept in |path|, single precision in |path|.float
+    bool ImportWisdom(const std::string& path);
+    bool ExportWisdom(const std::string& path);
+
+    ~DctPlanRegistry();
+
+private:
+    DctPlanRegistry() = default;
+
+    template <class T>
+    std::map<std::pair<size_t, size_t>, typename FftwTraits<T>::Plan>& Plans();
+
+private:
+    std::mutex mutex_;
+    PlanRigor rigor_ = PlanRigor::Estimate;
+    std::map<std::pair<size_t, size_t>, fftw_plan> double_plans_;  // by width and blocks
+    std::map<std::pair<size_t, size_t>, fftwf_plan> float_plans_;
+};
+
+// Factor inverse DCT expects input[i * width + j] to be multiplied by
+// (output normalization included), callers fold it into quantization tables.
+double DctInputScale(size_t i, size_t j);
+
+template <class T>
 class DctCalculator {
+    /*
+            Inverse DCT of width by width blocks stored one after another, usually a whole
+            MCU row of some channel. Blocks are transformed kMaxBatch per FFTW call,
+            which amortizes the call overhead dominating such small transforms.
+    */
 public:
-    // input and output are width by width matrices, first row, then
-    // the second row.
-    DctCalculator(size_t width, std::vector<double>* input, std::vector<double>* output);
+    constexpr static inline size_t kMaxBatch = 64;
+
+    DctCalculator(size_t width, size_t blocks);
+
+    T* Input(size_t block) {
+        return input_.data() + block * width_ * width_;
+    }
+
+    const T* Output(size_t block) const {
+        return output_.data() + block * width_ * width_;
+    }
 
-    void Inverse();
+    T* Output(size_t block) {
+        return output_.data() + block * width_ * width_;
+    }
 
-    ~DctCalculator();
+    // Transforms first |blocks| blocks, input must be prescaled by DctInputScale
+    // and is destroyed.
+    void Inverse(size_t blocks);
 
 private:
-    fftw_plan plan_;
-    std::vector<double>* input_;
-    std::vector<double>* output_;
     size_t width_;
+    DctBuffer<T> input_;
+    DctBuffer<T> output_;
+    typename FftwTraits<T>::Plan batch_plan_ = nullptr;  // owned by DctPlanRegistry
+    typename FftwTraits<T>::Plan remainder_plan_ = nullptr;
+    size_t remainder_ = 0;
 };
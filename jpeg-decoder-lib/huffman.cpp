@@ -118,3 +118,7 @@ bool HuffmanTree::Move(bool bit, int &value) {
         return false;
     }
 }
+
+void HuffmanTree::Reset() {
+    current_vertex_ = root_;
+}
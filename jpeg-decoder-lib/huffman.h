@@ -21,6 +21,9 @@ public:
     // and value is unmodified.
     bool Move(bool bit, int& value);
 
+    // Drops partially read code, next Move starts from the root.
+    void Reset();
+
 private:
     struct Node {
         std::optional<uint8_t> value;
@@ -0,0 +1,105 @@
+#include "lazy_image.h"
+
+#include <glog/logging.h>
+#include <stdexcept>
+
+#include "context.h"
+#include "decoder.h"
+#include "marker_controller.h"
+
+LazyImage::LazyImage(std::istream& input, const DecodeOptions& options, size_t band_rows,
+                     size_t max_memory)
+    : options_(options),
+      band_rows_(band_rows),
+      max_memory_(max_memory) {
+    if (!band_rows) {
+        throw std::invalid_argument("Band must have at least one MCU row");
+    }
+
+    options_.first_row = options_.row_count = 0;
+    options_.first_column = options_.column_count = 0;
+    options_.scan_index = nullptr;
+    options_.index_rows = band_rows;
+    options_.apply_orientation = false;  // bands are rows of the stored picture
+    options_.output_width = options_.output_height = 0;
+
+    PictureContext context;
+    context.options = options_;
+    MarkerController controller(&input, &context);
+    sections_ = controller.Share();
+
+    width_ = context.OutputWidth();
+    height_ = context.OutputHeight();
+    band_height_ = band_rows * context.mcu_height / options_.scale_denominator;
+}
+
+RGB LazyImage::GetPixel(size_t y, size_t x) {
+    size_t row;
+    const Image& band = GetBand(y, &row);
+    if (x >= width_) {
+        throw std::invalid_argument("Pixel is out of the image");
+    }
+    return band.GetPixel(row, x);
+}
+
+int LazyImage::GetGray(size_t y, size_t x) {
+    if (!Image::IsGray(options_.output_format)) {
+        throw std::logic_error("Gray values need Gray8 or Gray16 output");
+    }
+    size_t row;
+    const Image& band = GetBand(y, &row);
+    if (x >= width_) {
+        throw std::invalid_argument("Pixel is out of the image");
+    }
+    return band.GetGray(row, x);
+}
+
+const Image& LazyImage::GetBand(size_t y, size_t* band_row) {
+    if (y >= height_) {
+        throw std::invalid_argument("Pixel is out of the image");
+    }
+
+    size_t number = y / band_height_;
+    *band_row = y % band_height_;
+
+    auto it = bands_.find(number);
+    if (it != bands_.end()) {
+        lru_.splice(lru_.begin(), lru_, it->second.position);
+        return it->second.image;
+    }
+
+    DLOG(INFO) << "Decoding band " << number << " of lazy image";
+
+    DecodeOptions options = options_;
+    options.first_row = number * band_height_;
+    options.row_count = band_height_;
+    options.scan_index = index_;
+
+    Decoder decoder(sections_, options);
+    Image image = decoder.Decode();
+    ++decode_count_;
+    // multi-scan pictures have no index, each band decodes the scans again
+    if (auto index = decoder.GetScanIndex()) {
+        index_ = std::move(index);
+    }
+
+    size_t bytes = image.Width() * image.Height() * Image::PixelBytes(options_.output_format);
+
+    lru_.push_front(number);
+    Band& band = bands_[number];
+    band = {std::move(image), bytes, lru_.begin()};
+    memory_ += bytes;
+    Evict();
+
+    return band.image;
+}
+
+void LazyImage::Evict() {
+    // the band just used stays, even alone over the limit
+    while (max_memory_ && memory_ > max_memory_ && lru_.size() > 1) {
+        auto it = bands_.find(lru_.back());
+        memory_ -= it->second.bytes;
+        bands_.erase(it);
+        lru_.pop_back();
+    }
+}
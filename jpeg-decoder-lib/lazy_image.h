@@ -0,0 +1,85 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <list>
+#include <memory>
+#include <unordered_map>
+
+#include "options.h"
+#include "scan_index.h"
+#include "utils/image.h"
+
+struct SeparatedSections;
+
+class LazyImage {
+    /*
+            Image decoded in bands of MCU rows on first access to their pixels.
+            The constructor separates the sections and destuffs the scan data once,
+            so size and format are known up front and bands decode from memory.
+            Each band decode extends a scan index by the checkpoint at its bottom,
+            later bands start there instead of the scan start.
+            Bands live in LRU order and the oldest are dropped once decoded
+            bands exceed |max_memory| bytes, zero keeps every band.
+            Not thread-safe, pixels are read through non-const methods.
+    */
+public:
+    // Reads the whole input. Band, index, orientation and resize fields of |options|
+    // are ignored.
+    LazyImage(std::istream& input, const DecodeOptions& options = {}, size_t band_rows = 4,
+              size_t max_memory = 0);
+
+    size_t Width() const {
+        return width_;
+    }
+
+    size_t Height() const {
+        return height_;
+    }
+
+    PixelFormat Format() const {
+        return options_.output_format;
+    }
+
+    RGB GetPixel(size_t y, size_t x);
+
+    // Gray8 and Gray16 output only, like Image::GetGray.
+    int GetGray(size_t y, size_t x);
+
+    // Bands decoded so far, counting decodes of evicted bands again.
+    size_t DecodeCount() const {
+        return decode_count_;
+    }
+
+    // Bytes held by cached bands.
+    size_t MemoryUsage() const {
+        return memory_;
+    }
+
+private:
+    struct Band {
+        Image image;
+        size_t bytes;
+        std::list<size_t>::iterator position;  // in lru_
+    };
+
+    // Band of image row |y|, decoded if it is not cached.
+    const Image& GetBand(size_t y, size_t* band_row);
+
+    void Evict();
+
+private:
+    std::shared_ptr<const SeparatedSections> sections_;
+    DecodeOptions options_;
+    size_t width_ = 0;
+    size_t height_ = 0;
+    size_t band_rows_ = 0;    // MCU rows
+    size_t band_height_ = 0;  // image rows
+    size_t max_memory_ = 0;
+    size_t memory_ = 0;
+    size_t decode_count_ = 0;
+    std::shared_ptr<const ScanIndex> index_;
+    std::unordered_map<size_t, Band> bands_;
+    std::list<size_t> lru_;  // most recently used first
+};
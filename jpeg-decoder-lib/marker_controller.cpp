@@ -1,13 +1,82 @@
 #include "marker_controller.h"
 
+#include <bit>
+#include <cstring>
 #include <memory>
 #include <stdexcept>
 #include <glog/logging.h>
 
+#include "trace.h"
+
+#if defined(__SSE2__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+namespace {
+
+// First 0xFF byte in [begin, end) or end. It starts every marker and stuffed byte,
+// clean scan data between them is skipped 32 or 16 bytes per step.
+const uint8_t* FindMarkerPrefix(const uint8_t* begin, const uint8_t* end) {
+#if defined(__AVX2__)
+    const __m256i prefix32 = _mm256_set1_epi8(static_cast<char>(0xFF));
+    for (; end - begin >= 32; begin += 32) {
+        __m256i data = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(begin));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(data, prefix32));
+        if (mask) {
+            return begin + std::countr_zero(mask);
+        }
+    }
+#endif
+#if defined(__SSE2__)
+    const __m128i prefix16 = _mm_set1_epi8(static_cast<char>(0xFF));
+    for (; end - begin >= 16; begin += 16) {
+        __m128i data = _mm_loadu_si128(reinterpret_cast<const __m128i*>(begin));
+        uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(data, prefix16));
+        if (mask) {
+            return begin + std::countr_zero(mask);
+        }
+    }
+#endif
+    const void* found = std::memchr(begin, 0xFF, end - begin);
+    return found ? static_cast<const uint8_t*>(found) : end;
+}
+
+// Event names of handled sections.
+const char* SectionName(SectionID marker) {
+    switch (marker) {
+        case SectionID::SOF0:
+            return "SOF0";
+        case SectionID::SOF1:
+            return "SOF1";
+        case SectionID::DHT:
+            return "DHT";
+        case SectionID::DQT:
+            return "DQT";
+        case SectionID::SOS:
+            return "SOS";
+        case SectionID::DRI:
+            return "DRI";
+        case SectionID::COM:
+            return "COM";
+        case SectionID::APP1:
+            return "APP1";
+        case SectionID::APP14:
+            return "APP14";
+        default:
+            return "APP";
+    }
+}
+
+}  // namespace
+
 bool IsAppMarker(uint16_t marker_num) {
     return (marker_num >= 0xFFE0 && marker_num <= 0xFFEF);
 }
 
+bool IsRestartMarker(uint16_t marker_num) {
+    return (marker_num >= 0xFFD0 && marker_num <= 0xFFD7);
+}
+
 SectionID DoubleByteToMarker(uint16_t num) {
     if (num == static_cast<uint16_t>(SectionID::COM)) {
         return SectionID::COM;
@@ -19,10 +88,20 @@ SectionID DoubleByteToMarker(uint16_t num) {
         return SectionID::SOS;
     } else if (num == static_cast<uint16_t>(SectionID::SOF0)) {
         return SectionID::SOF0;
+    } else if (num == static_cast<uint16_t>(SectionID::SOF1)) {
+        return SectionID::SOF1;
     } else if (num == static_cast<uint16_t>(SectionID::SOI)) {
         return SectionID::SOI;
     } else if (num == static_cast<uint16_t>(SectionID::EOI)) {
         return SectionID::EOI;
+    } else if (num == static_cast<uint16_t>(SectionID::DRI)) {
+        return SectionID::DRI;
+    } else if (IsRestartMarker(num)) {
+        return SectionID::RST;
+    } else if (num == static_cast<uint16_t>(SectionID::APP1)) {
+        return SectionID::APP1;
+    } else if (num == static_cast<uint16_t>(SectionID::APP14)) {
+        return SectionID::APP14;
     } else if (IsAppMarker(num)) {
         return SectionID::APP;
     } else {
@@ -33,35 +112,168 @@ SectionID DoubleByteToMarker(uint16_t num) {
 MarkerFactory::MarkerFactory() {
     handlers_[SectionID::SOS] = std::make_unique<SectionSOS>();
     handlers_[SectionID::COM] = std::make_unique<SectionCOM>();
-    handlers_[SectionID::SOF0] = std::make_unique<SectionSOF0>();
+    handlers_[SectionID::SOF0] = std::make_unique<SectionSOF0>(false);
+    handlers_[SectionID::SOF1] = std::make_unique<SectionSOF0>(true);
     handlers_[SectionID::DQT] = std::make_unique<SectionDQT>();
     handlers_[SectionID::DHT] = std::make_unique<SectionDHT>();
     handlers_[SectionID::APP] = std::make_unique<SectionAPP>();
+    handlers_[SectionID::APP1] = std::make_unique<SectionAPP1>();
+    handlers_[SectionID::APP14] = std::make_unique<SectionAPP14>();
+    handlers_[SectionID::DRI] = std::make_unique<SectionDRI>();
 }
 
 void MarkerFactory::Handle(SectionID marker, BitReader<std::vector<uint8_t>>& reader,
                            PictureContext* context) {
     auto it = handlers_.find(marker);
-    CHECK(it != handlers_.end());
+    if (it == handlers_.end()) {
+        throw std::invalid_argument("No handler for marker: `" +
+                                    NumToHexString(static_cast<uint16_t>(marker)) + "`");
+    }
 
+    TraceScope trace(SectionName(marker));
     it->second->Handle(reader, context);
 }
 
+MarkerController::MarkerController(std::shared_ptr<const SeparatedSections> separated,
+                                   PictureContext* context)
+    : reader_(static_cast<std::istream*>(nullptr)),
+      context_(context),
+      started_(true),
+      finished_(true) {
+    context_->restart_positions = separated->restart_positions;
+    for (const auto& bytes : separated->sections) {
+        context_->buffered_bytes += bytes.size();
+    }
+    shared_ = std::move(separated);
+}
+
+std::shared_ptr<const SeparatedSections> MarkerController::Share() {
+    Separate();
+    ProcessHeaders();
+    if (!shared_) {
+        auto separated = std::make_shared<SeparatedSections>();
+        separated->sections = std::move(sections_);
+        separated->restart_positions = context_->restart_positions;
+        shared_ = std::move(separated);
+    }
+    return shared_;
+}
+
+void MarkerController::Charge(size_t bytes) {
+    const DecodeLimits& limits = context_->options.limits;
+
+    context_->buffered_bytes += bytes;
+    if (limits.max_memory && context_->buffered_bytes > limits.max_memory) {
+        throw LimitExceededError("Buffered sections exceed memory limit: " +
+                                 std::to_string(limits.max_memory));
+    }
+}
+
+SectionID MarkerController::SeparateScan(std::vector<uint8_t>& bytes) {
+    // scan data is not measured
+    constexpr size_t kChunkSize = 1 << 16;
+    const DecodeLimits& limits = context_->options.limits;
+
+    auto append = [&](const uint8_t* begin, const uint8_t* end) {
+        size_t count = end - begin;
+        scan_bytes_ += count;
+        if (limits.max_scan_bytes && scan_bytes_ > limits.max_scan_bytes) {
+            throw LimitExceededError("Scan data exceeds limit: " +
+                                     std::to_string(limits.max_scan_bytes));
+        }
+        Charge(count);
+        bytes.insert(bytes.end(), begin, end);
+    };
+
+    std::vector<size_t>& restarts = context_->restart_positions->emplace_back();
+
+    // runs between 0xFF bytes are copied whole, only markers and stuffing are looked at
+    std::vector<uint8_t> chunk(kChunkSize);
+    try {
+        while (true) {
+            size_t size = reader_.ReadBuffered(chunk.data(), chunk.size());
+            if (!size) {
+                throw std::runtime_error("Cannot read, seems like EOF");
+            }
+
+            const uint8_t* position = chunk.data();
+            const uint8_t* end = position + size;
+            while (position != end) {
+                const uint8_t* prefix = FindMarkerPrefix(position, end);
+                append(position, prefix);
+                if (prefix == end) {
+                    break;
+                }
+
+                // second byte of a pair split between chunks is read past the chunk
+                uint8_t code = (prefix + 1 != end) ? prefix[1] : reader_.ReadByte();
+                position = std::min(prefix + 2, end);
+                if (!code) {
+                    append(prefix, prefix + 1);  // stuffed 0xFF00
+                    continue;
+                }
+
+                uint16_t possible_marker_num = (0xFF << kBitsInByte) + code;
+                SectionID marker = DoubleByteToMarker(possible_marker_num);
+                if (marker == SectionID::RST) {
+                    restarts.push_back(bytes.size());
+                } else if (marker != SectionID::INVALID) {
+                    reader_.Unread(end - position);  // bytes after the scan
+                    return marker;
+                } else if (context_->options.tolerant) {
+                    DLOG(INFO) << "Dropping garbage marker "
+                               << NumToHexString(possible_marker_num) << " in scan data";
+                } else {
+                    throw std::invalid_argument("No such marker: `" +
+                                                NumToHexString(possible_marker_num) + "`");
+                }
+            }
+        }
+    } catch (const LimitExceededError&) {
+        throw;
+    } catch (const std::runtime_error&) {
+        if (!context_->options.tolerant || !reader_.IsEnd()) {
+            throw;
+        }
+        DLOG(INFO) << "Input ended inside scan data";
+        context_->status.truncated = true;
+        return SectionID::INVALID;
+    }
+}
+
 void MarkerController::SeparateAndProcess() {
-    DLOG(INFO) << "Start separating markers content to buffers";
+    Separate();
+    Process();
+}
+
+void MarkerController::Separate() {
+    SeparateUntil(SectionID::EOI);
+}
+
+void MarkerController::SeparateHeaders() {
+    SeparateUntil(SectionID::SOS);
+}
 
-    if (DoubleByteToMarker(reader_.ReadDoubleByte()) != SectionID::SOI) {
-        throw std::invalid_argument("Image must start with SOI marker");
+void MarkerController::SeparateUntil(SectionID stop) {
+    if (finished_) {
+        return;
     }
 
-    sections_.reserve(10);
+    DLOG(INFO) << "Start separating markers content to buffers";
+    TraceScope trace("separate markers");
 
-    SectionID marker_after_scan = SectionID::INVALID;
+    if (!started_) {
+        if (DoubleByteToMarker(reader_.ReadDoubleByte()) != SectionID::SOI) {
+            throw std::invalid_argument("Image must start with SOI marker");
+        }
+        started_ = true;
+        sections_.reserve(10);
+    }
 
     while (true) {
-        uint16_t marker_num = (marker_after_scan != SectionID::INVALID)
-                                  ? static_cast<uint16_t>(marker_after_scan)
-                                  : reader_.ReadDoubleByte();
+        uint16_t marker_num = (pending_ != SectionID::INVALID) ? static_cast<uint16_t>(pending_)
+                                                               : reader_.ReadDoubleByte();
+        pending_ = SectionID::INVALID;
 
         SectionID marker = DoubleByteToMarker(marker_num);
 
@@ -73,7 +285,17 @@ void MarkerController::SeparateAndProcess() {
             throw std::invalid_argument("Two SOI markers");
         }
 
+        if (marker == SectionID::RST) {
+            throw std::invalid_argument("Restart marker outside of scan data");
+        }
+
         if (marker == SectionID::EOI) {
+            finished_ = true;
+            break;
+        }
+
+        if (marker == stop) {
+            pending_ = marker;
             break;
         }
 
@@ -85,6 +307,8 @@ void MarkerController::SeparateAndProcess() {
 
         DLOG(INFO) << "Met " << NumToHexString(marker_num) << " marker, size: " << length;
 
+        Charge(length + 2);
+
         sections_.emplace_back();
         sections_.back().reserve(length + 2);
 
@@ -99,42 +323,70 @@ void MarkerController::SeparateAndProcess() {
         }
 
         if (marker == SectionID::SOS) {
-            // scan data is not measured
-            while (true) {
-                uint8_t byte = reader_.ReadByte();
-                if (byte == 0xFF) {
-                    uint16_t possible_marker_num =
-                        (static_cast<uint16_t>(byte) << kBitsInByte) + reader_.ReadByte();
-                    if (possible_marker_num != 0xFF00) {
-                        marker_after_scan = DoubleByteToMarker(possible_marker_num);
-                        if (marker_after_scan != SectionID::INVALID) {
-                            break;
-                        } else {
-                            throw std::invalid_argument("No such marker: `" +
-                                                        NumToHexString(marker_num) + "`");
-                        }
-                    }
-                }
-                sections_.back().push_back(byte);
+            pending_ = SeparateScan(sections_.back());
+            if (pending_ == SectionID::INVALID) {
+                finished_ = true;
+                break;  // truncated input, decode what we have
             }
         }
     }
 
-    DLOG(INFO) << "Separated markers successfully, start processing stages\n\n";
+    DLOG(INFO) << "Separated markers successfully\n\n";
+}
+
+void MarkerController::Process() {
+    ProcessHeaders();
+    ProcessScans();
+}
+
+void MarkerController::ProcessHeaders() {
+    DLOG(INFO) << "Start processing stages";
+
+    MarkerOrderComparator comp({{SectionID::SOF0, 0},
+                                {SectionID::SOF1, 0},
+                                {SectionID::APP14, 0},
+                                {SectionID::DRI, 0},
+                                {SectionID::DHT, 1},
+                                {SectionID::DQT, 2},
+                                {SectionID::SOS, 3}});
 
-    MarkerOrderComparator comp(
-        {{SectionID::SOF0, 0}, {SectionID::DHT, 1}, {SectionID::DQT, 2}, {SectionID::SOS, 3}});
+    auto marker_of = [](const std::vector<uint8_t>& bytes) {
+        return DoubleByteToMarker((bytes[0] << kBitsInByte) + bytes[1]);
+    };
 
-    std::sort(sections_.begin(), sections_.end(),
-              [&](const std::vector<uint8_t>& lhs, const std::vector<uint8_t>& rhs) {
-                  return comp(DoubleByteToMarker((lhs[0] << kBitsInByte) + lhs[1]),
-                              DoubleByteToMarker((rhs[0] << kBitsInByte) + rhs[1]));
-              });
+    // shared sections are ordered already
+    if (!shared_) {
+        // sections from the first scan on keep stream order, tables may change between scans
+        auto first_scan = std::find_if(sections_.begin() + processed_, sections_.end(),
+                                       [&](const std::vector<uint8_t>& bytes) {
+                                           return marker_of(bytes) == SectionID::SOS;
+                                       });
 
-    MarkerFactory marker_processor;
+        std::sort(sections_.begin() + processed_, first_scan,
+                  [&](const std::vector<uint8_t>& lhs, const std::vector<uint8_t>& rhs) {
+                      return comp(marker_of(lhs), marker_of(rhs));
+                  });
+    }
 
-    for (auto& bytes : sections_) {
-        BitReader reader(&bytes);
-        marker_processor.Handle(DoubleByteToMarker(reader.ReadDoubleByte()), reader, context_);
+    const auto& sections = Sections();
+    for (; processed_ < sections.size() && marker_of(sections[processed_]) != SectionID::SOS;
+         ++processed_) {
+        BitReader<std::vector<uint8_t>> reader(&sections[processed_]);
+        factory_.Handle(DoubleByteToMarker(reader.ReadDoubleByte()), reader, context_);
     }
-}
\ No newline at end of file
+}
+
+void MarkerController::ProcessScans() {
+    const auto& sections = Sections();
+    try {
+        for (; processed_ < sections.size(); ++processed_) {
+            BitReader<std::vector<uint8_t>> reader(&sections[processed_]);
+            factory_.Handle(DoubleByteToMarker(reader.ReadDoubleByte()), reader, context_);
+        }
+    } catch (...) {
+        context_->CancelScans();  // they read sections
+        throw;
+    }
+
+    context_->FinishScans();
+}
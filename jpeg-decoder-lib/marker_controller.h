@@ -18,8 +18,13 @@ enum class SectionID {
     DQT = 0xFFDB,   // define quantization table
     DHT = 0xFFC4,   // define huffman table
     SOF0 = 0xFFC0,  // meta information about image
+    SOF1 = 0xFFC1,  // extended sequential frame: 8 or 12-bit samples
     SOS = 0xFFDA,   // start of scan
     APP = 0xFFE0,   // app information (ignored in this implementation)
+    APP1 = 0xFFE1,  // EXIF
+    APP14 = 0xFFEE, // Adobe color transform
+    DRI = 0xFFDD,   // define restart interval
+    RST = 0xFFD0,   // restart markers RST0..RST7, met only inside scan data
     INVALID = 0xFF00,
 };
 
@@ -54,6 +59,12 @@ std::string NumToHexString(T val) {
     return ss.str();
 }
 
+// Sections of a whole picture with scan data destuffed, headers in processing order.
+struct SeparatedSections {
+    std::vector<std::vector<uint8_t>> sections;
+    std::shared_ptr<std::vector<std::vector<size_t>>> restart_positions;
+};
+
 class MarkerController {  // separates binary data for markers
                           // (thanks for unspecified order of sections in jpeg!)
 public:
@@ -61,10 +72,54 @@ public:
         : reader_(input), context_(context) {
     }
 
+    // Processes sections separated by another controller, they are read in place.
+    MarkerController(std::shared_ptr<const SeparatedSections> separated, PictureContext* context);
+
     void SeparateAndProcess();
 
+    // Reads input up to EOI, buffering each section with its marker and length.
+    void Separate();
+
+    // Reads input up to the first scan only, Separate continues from there.
+    void SeparateHeaders();
+
+    // Runs handlers over buffered sections in dependency order.
+    void Process();
+
+    // Process split in two: sections defining the picture and its tables,
+    // then scans. Tables may be completed in between (frames of MJPEG stream).
+    void ProcessHeaders();
+    void ProcessScans();
+
+    // Separates the rest of the input and processes headers, then hands the sections to
+    // controllers made from them, so each of them decodes without reading the input again.
+    std::shared_ptr<const SeparatedSections> Share();
+
+private:
+    const std::vector<std::vector<uint8_t>>& Sections() const {
+        return shared_ ? shared_->sections : sections_;
+    }
+
+    void SeparateUntil(SectionID stop);
+
+    // Moves entropy coded data after SOS header to |bytes|, recording restart marker positions.
+    // Input is taken in buffered chunks, bytes following the end marker are given back.
+    // Returns the marker ending the scan, or INVALID if input ended inside the scan
+    // (allowed only in tolerant mode).
+    SectionID SeparateScan(std::vector<uint8_t>& bytes);
+
+    // Accounts buffered bytes against memory limit.
+    void Charge(size_t bytes);
+
 private:
     BitReader<std::istream> reader_;
     std::vector<std::vector<uint8_t>> sections_;
+    std::shared_ptr<const SeparatedSections> shared_;  // replaces sections_ when set
+    size_t processed_ = 0;  // sections already passed to handlers
+    MarkerFactory factory_;
     PictureContext* context_;
+    size_t scan_bytes_ = 0;
+    bool started_ = false;   // SOI is read
+    bool finished_ = false;  // EOI or end of input is reached
+    SectionID pending_ = SectionID::INVALID;  // marker read, but its section is not
 };
\ No newline at end of file
@@ -1,6 +1,116 @@
 #include "marker_handlers.h"
 #include <stdexcept>
+#include <string_view>
 #include <glog/logging.h>
+#include <future>
+#include "coefficient_store.h"
+#include "exif.h"
+#include "stage_times.h"
+#include "thread_pool.h"
+#include "table_cache.h"
+#include "trace.h"
+
+void SectionAPP::Process(BitReader<std::vector<uint8_t>>& reader, PictureContext* context) {
+    constexpr std::string_view kJfxxSignature("JFXX\0", 5);
+    constexpr uint8_t kJpegThumbnail = 0x10;
+
+    uint16_t size = reader.ReadDoubleByte();
+    if (size < 2 + kJfxxSignature.size() + 1) {
+        return;
+    }
+
+    std::string signature(kJfxxSignature.size(), '\0');
+    reader.FillString(signature);
+    if (signature != kJfxxSignature || reader.ReadByte() != kJpegThumbnail) {
+        return;
+    }
+
+    DLOG(INFO) << "Met JFXX JPEG thumbnail";
+
+    std::vector<uint8_t> thumbnail(size - 2 - kJfxxSignature.size() - 1);
+    reader.FillVector(thumbnail);
+    if (context->thumbnail.empty()) {
+        context->thumbnail = std::move(thumbnail);
+    }
+}
+
+void SectionAPP1::Process(BitReader<std::vector<uint8_t>>& reader, PictureContext* context) {
+    DLOG(INFO) << "Processing APP1 section";
+
+    constexpr std::string_view kExifSignature("Exif\0\0", 6);
+
+    uint16_t size = reader.ReadDoubleByte();
+    if (size < 2 + kExifSignature.size()) {
+        return;
+    }
+
+    std::string signature(kExifSignature.size(), '\0');
+    reader.FillString(signature);
+    if (signature != kExifSignature) {
+        DLOG(INFO) << "Not an EXIF marker, skipping";
+        return;
+    }
+
+    std::vector<uint8_t> tiff(size - 2 - kExifSignature.size());
+    reader.FillVector(tiff);
+
+    ExifInfo info;
+    try {
+        info = ParseExif(tiff);
+    } catch (const std::invalid_argument& e) {
+        DLOG(INFO) << "Ignoring malformed EXIF: " << e.what();
+        return;
+    }
+
+    context->orientation = info.orientation;
+
+    if (info.thumbnail_offset && context->thumbnail.empty()) {
+        auto begin = tiff.begin() + *info.thumbnail_offset;
+        context->thumbnail.assign(begin, begin + info.thumbnail_size);
+        DLOG(INFO) << "EXIF thumbnail size: " << info.thumbnail_size;
+    }
+
+    DLOG(INFO) << "Finished processing APP1 section\n\n";
+}
+
+void SectionAPP14::Process(BitReader<std::vector<uint8_t>>& reader, PictureContext* context) {
+    DLOG(INFO) << "Processing APP14 section";
+
+    constexpr std::string_view kAdobeSignature = "Adobe";
+    constexpr size_t kAdobeSize = 12;  // signature, version, 2 flag words, transform
+
+    uint16_t size = reader.ReadDoubleByte();
+
+    std::string content(size - 2, '\0');
+    reader.FillString(content);
+
+    if (content.size() < kAdobeSize || !content.starts_with(kAdobeSignature)) {
+        DLOG(INFO) << "Not an Adobe marker, skipping";
+        return;
+    }
+
+    context->adobe_transform = content[kAdobeSize - 1];
+
+    DLOG(INFO) << "Adobe transform: " << static_cast<size_t>(*context->adobe_transform);
+
+    DLOG(INFO) << "Finished processing APP14 section\n\n";
+}
+
+void SectionDRI::Process(BitReader<std::vector<uint8_t>>& reader, PictureContext* context) {
+    DLOG(INFO) << "Processing DRI section";
+
+    uint16_t size = reader.ReadDoubleByte();
+
+    if (size != 4) {
+        throw std::invalid_argument("DRI section size must be 4");
+    }
+
+    context->restart_interval = reader.ReadDoubleByte();
+
+    DLOG(INFO) << "Restart interval: " << context->restart_interval;
+
+    DLOG(INFO) << "Finished processing DRI section\n\n";
+}
 
 void SectionDHT::Process(BitReader<std::vector<uint8_t>>& reader, PictureContext* context) {
     DLOG(INFO) << "Processing DHT section";
@@ -31,14 +141,11 @@ void SectionDHT::Process(BitReader<std::vector<uint8_t>>& reader, PictureContext
         std::unordered_map<uint8_t, HuffmanTree>& trees =
             (type == 1) ? context->ac_huffman_trees : context->dc_huffman_trees;
 
-        if (trees.contains(id)) {
+        if (trees.contains(id) && !context->scans) {  // scans take trees defined before them
             throw std::invalid_argument("Section DHT overrides previous Huffman tree");
         }
 
-        HuffmanTree tree;
-        tree.Build(code_lengths, values);
-
-        trees[id] = std::move(tree);
+        trees[id] = TableCache::Instance().GetHuffmanTree(code_lengths, values);
     }
 
     DLOG(INFO) << "Finished processing DHT section\n\n";
@@ -51,10 +158,18 @@ void SectionSOF0::Process(BitReader<std::vector<uint8_t>>& reader, PictureContex
 
     DLOG(INFO) << "Size: " << size;
 
+    if (!context->channels.empty()) {
+        throw std::invalid_argument("Several frame headers");  // SOF0 and SOF1
+    }
+
     context->precision = reader.ReadByte();
     context->height = reader.ReadDoubleByte();
     context->width = reader.ReadDoubleByte();
     context->channels.resize(reader.ReadByte());
+
+    if (context->channels.empty()) {
+        throw std::invalid_argument("No channels in SOF0 section");
+    }
     // 8 bytes read by now
 
     DLOG(INFO) << "Precision: " << static_cast<size_t>(context->precision);
@@ -66,35 +181,39 @@ void SectionSOF0::Process(BitReader<std::vector<uint8_t>>& reader, PictureContex
         throw std::invalid_argument("Empty jpg");
     }
 
-    if (context->precision != 8 && context->precision != 16) {
-        throw std::invalid_argument("Precision is not 8, nor 16");
+    if (context->precision != 8 && !(extended_ && context->precision == 12)) {
+        throw std::invalid_argument("Precision must be 8, or 12 in SOF1 frames");
     }
 
-    context->image.SetSize(context->width, context->height);
-
     uint8_t hmax = 0;
     uint8_t vmax = 0;
 
     DLOG(INFO) << "Channel thinning info: ";
 
     for (uint8_t i = 0; i < context->channels.size(); ++i) {
-        uint8_t id = reader.ReadByte();
-        --id;
+        // ids are arbitrary (1..3 for JFIF, 'R', 'G', 'B' or 0..3 for Adobe),
+        // channels are kept in SOF0 order
+        Channel& channel = context->channels[i];
+        channel.id = reader.ReadByte();
+
+        DLOG(INFO) << "Channel Id: " << static_cast<size_t>(channel.id);
 
-        DLOG(INFO) << "Channel Id: " << static_cast<size_t>(id);
+        for (uint8_t j = 0; j < i; ++j) {
+            if (context->channels[j].id == channel.id) {
+                throw std::invalid_argument("Channel id duplicate in SOF0 section");
+            }
+        }
 
-        context->channels[id].horizontal_thinning = reader.ReadHalfByte();
-        context->channels[id].vertical_thinning = reader.ReadHalfByte();
-        context->channels[id].qt_id = reader.ReadByte();
+        channel.horizontal_thinning = reader.ReadHalfByte();
+        channel.vertical_thinning = reader.ReadHalfByte();
+        channel.qt_id = reader.ReadByte();
 
-        DLOG(INFO) << "Horizontal: "
-                   << static_cast<size_t>(context->channels[id].horizontal_thinning)
-                   << " vertical: " << static_cast<size_t>(context->channels[id].vertical_thinning)
-                   << " quantization table id: "
-                   << static_cast<size_t>(context->channels[id].qt_id);
+        DLOG(INFO) << "Horizontal: " << static_cast<size_t>(channel.horizontal_thinning)
+                   << " vertical: " << static_cast<size_t>(channel.vertical_thinning)
+                   << " quantization table id: " << static_cast<size_t>(channel.qt_id);
 
-        hmax = std::max(hmax, context->channels[id].horizontal_thinning);
-        vmax = std::max(vmax, context->channels[id].vertical_thinning);
+        hmax = std::max(hmax, channel.horizontal_thinning);
+        vmax = std::max(vmax, channel.vertical_thinning);
     }
 
     for (size_t i = 0; i < context->channels.size(); ++i) {
@@ -150,6 +269,106 @@ void SectionCOM::Process(BitReader<std::vector<uint8_t>>& reader, PictureContext
     DLOG(INFO) << "Finished processing COM section\n\n";
 }
 
+namespace {
+
+struct ScanBand {
+    size_t begin_row;  // in MCU rows
+    size_t end_row;
+    const ScanCheckpoint* checkpoint;  // decoder state at begin_row, nullptr at scan start
+};
+
+// Decodes MCU rows of the band with own reader, tables and MCU buffers, so bands
+// can be decoded concurrently. Appends checkpoints the band passes beyond the last
+// one of |index|, if it is given.
+DecodeStatus DecodeBand(BitReader<std::vector<uint8_t>> reader, size_t scan_start,
+                        std::vector<ScanChannel> scan_channels, const ScanBand& band,
+                        const std::vector<size_t>& restarts, PictureContext* context,
+                        ScanIndex* index) {
+    DecodeStatus status;
+    size_t columns = (context->width + context->mcu_width - 1) / context->mcu_width;
+    size_t scale = context->options.scale_denominator;
+
+    auto mcu_it = context->GetMCUBeginIterator(std::move(scan_channels));
+    mcu_it.Seek(band.begin_row);
+    if (band.checkpoint) {
+        reader.SeekBit(scan_start * kBitsInByte + band.checkpoint->bit_position);
+        mcu_it->SetPredictors(band.checkpoint->dc_predictors);
+    }
+
+    size_t restart_interval = context->restart_interval;
+    size_t mcu_index = band.begin_row * columns;
+    size_t mcus = columns * ((context->height + context->mcu_height - 1) / context->mcu_height);
+    int gray = 1 << (context->precision - 1);
+    bool skipping = false;  // tolerant mode: damaged interval, waiting for the next restart
+
+    auto record = [&] {
+        size_t step = index ? columns * index->rows_per_checkpoint : 0;
+        if (index && mcu_index < mcus && mcu_index % step == 0 &&
+            mcu_index / step == index->checkpoints.size()) {
+            index->checkpoints.push_back(
+                {reader.BitPosition() - scan_start * kBitsInByte, mcu_it->GetPredictors()});
+        }
+    };
+
+    while (mcu_index < band.end_row * columns) {
+        DLOG_EVERY_N(INFO, 100) << "Processing " << mcu_index << "th MCU out of " << mcus;
+
+        record();
+
+        try {
+            if (restart_interval && mcu_index && mcu_index % restart_interval == 0) {
+                size_t restart = mcu_index / restart_interval - 1;
+                if (restart >= restarts.size()) {
+                    throw std::invalid_argument("Restart marker is missing");
+                }
+
+                size_t position = restarts[restart];
+                if (!skipping && reader.BytePosition() > position) {
+                    throw std::invalid_argument("Scan data overlaps restart marker");
+                }
+
+                reader.SeekByte(position);  // skips padding bits
+                mcu_it->ResetPredictors();
+                skipping = false;
+            }
+
+            if (!skipping) {
+                mcu_it.Process(reader);
+            }
+        } catch (const LimitExceededError&) {
+            throw;
+        } catch (const std::exception& e) {
+            if (!context->options.tolerant) {
+                throw;
+            }
+
+            if (status.complete) {
+                DLOG(INFO) << "Scan is damaged at row " << mcu_it.Row() << ": " << e.what();
+                size_t row = mcu_it.Row() / scale;
+                status.complete = false;
+                status.error = e.what();
+                status.valid_rows = row - std::min(row, context->options.first_row);
+            }
+            skipping = true;
+        }
+
+        if (skipping) {
+            mcu_it.Fill(gray);
+            ++status.damaged_mcus;
+        }
+
+        context->CountMCU();
+
+        ++mcu_it;
+        ++mcu_index;
+    }
+    record();  // the next band starts here
+
+    return status;
+}
+
+}  // namespace
+
 void SectionSOS::Process(BitReader<std::vector<uint8_t>>& reader, PictureContext* context) {
     DLOG(INFO) << "Processing SOS section";
 
@@ -159,27 +378,43 @@ void SectionSOS::Process(BitReader<std::vector<uint8_t>>& reader, PictureContext
     DLOG(INFO) << "Size: " << sz;
     DLOG(INFO) << "Channels: " << static_cast<size_t>(channels_count);
 
-    if (channels_count != context->channels.size()) {
+    size_t scan = context->scans++;
+    if (!scan) {
+        context->ResolveColorSpace();
+    }
+
+    if (!channels_count || channels_count > context->channels.size()) {
         throw std::invalid_argument("Different number of channels in SOF0 and SOS sections");
     }
 
-    std::vector<HuffmanTree> channel_dc(channels_count), channel_ac(channels_count);
-    std::vector<uint8_t> channel_ids;
+    std::vector<ScanChannel> scan_channels;
+    std::vector<uint8_t> channel_ids;  // indices in SOF0 order
+    scan_channels.reserve(channels_count);
     channel_ids.reserve(channels_count);
 
     for (size_t i = 0; i < channels_count; ++i) {
-        uint8_t id_channel = reader.ReadByte();
-        --id_channel;
-
-        if (context->channels.size() <= id_channel) {
-            throw std::invalid_argument("No such channel: `" + std::to_string(id_channel) + '`');
+        uint8_t component_id = reader.ReadByte();
+        auto it_channel =
+            std::find_if(context->channels.begin(), context->channels.end(),
+                         [&](const Channel& channel) { return channel.id == component_id; });
+
+        if (it_channel == context->channels.end()) {
+            throw std::invalid_argument("No such channel: `" + std::to_string(component_id) +
+                                        '`');
         }
 
+        uint8_t id_channel = it_channel - context->channels.begin();
+
         if (!channel_ids.empty() &&
             std::find(channel_ids.begin(), channel_ids.end(), id_channel) != channel_ids.end()) {
             throw std::invalid_argument("Channel description duplicate in SOS section");
         }
 
+        if (context->scanned_channels & (1 << id_channel)) {
+            throw std::invalid_argument("Channel is in several scans");
+        }
+        context->scanned_channels |= 1 << id_channel;
+
         channel_ids.emplace_back(id_channel);
 
         uint8_t dc_id = reader.ReadHalfByte();
@@ -189,19 +424,7 @@ void SectionSOS::Process(BitReader<std::vector<uint8_t>>& reader, PictureContext
                    << ", DC tree id: " << static_cast<size_t>(dc_id)
                    << ", AC tree id: " << static_cast<size_t>(ac_id);
 
-        auto it_dc = context->dc_huffman_trees.find(dc_id);
-        auto it_ac = context->ac_huffman_trees.find(ac_id);
-
-        if (it_dc == context->dc_huffman_trees.end()) {
-            throw std::invalid_argument("No DC Huffman tree with id: " + std::to_string(dc_id));
-        }
-
-        if (it_ac == context->ac_huffman_trees.end()) {
-            throw std::invalid_argument("No AC Huffman tree with id: " + std::to_string(ac_id));
-        }
-
-        channel_dc[i] = it_dc->second;
-        channel_ac[i] = it_ac->second;
+        scan_channels.emplace_back(context->PrepareScanChannel(id_channel, dc_id, ac_id));
     }
 
     if (channels_count * 2 + 6 != sz) {  // we read exactly channels_count * 2 + 3 bytes by now
@@ -216,36 +439,244 @@ void SectionSOS::Process(BitReader<std::vector<uint8_t>>& reader, PictureContext
         throw std::invalid_argument("Can not read progressive jpg");
     }
 
-    // prepare channels info
+    if (!scan && !context->coefficients) {
+        context->PrepareImage();
+    } else if (!scan) {
+        // captured pictures allocate no image, only pixel and section limits apply
+        context->CheckImageLimits(0, 0);
+    }
 
-    std::vector<Channel> channels;
-    channels.reserve(channels_count);
+    // scans separated by MarkerController have restart positions, sections given directly not
+    static const std::vector<size_t> kNoRestarts;
+    const auto& positions = *context->restart_positions;
+    const std::vector<size_t>& restarts = scan < positions.size() ? positions[scan] : kNoRestarts;
 
-    for (uint8_t index : channel_ids) {
-        channels.emplace_back(context->channels[index]);
-    }
+    const DecodeOptions& options = context->options;
+
+    if (scan || channels_count != context->channels.size()) {
+        if (options.scan_index) {
+            throw std::invalid_argument("Scan index does not match the picture");
+        }
+
+        CoefficientStore* store = context->coefficients;
+        if (!store) {
+            if (!context->scan_store) {
+                context->scan_store = std::make_shared<CoefficientStore>();
+                context->scan_store->context_ = context;
+            }
+            store = context->scan_store.get();
+        }
+        if (context->scan_tasks.empty()) {
+            // channel lists exist before scans run, so they can be filled concurrently
+            for (size_t c = 0; c < context->channels.size(); ++c) {
+                store->Pad(c, 0);
+            }
+        }
 
-    context->channels = std::move(channels);
+        auto task = [reader, scan_channels = std::move(scan_channels), &restarts, context,
+                     store]() mutable {
+            return DecodeToStore(reader, std::move(scan_channels), restarts, context, store);
+        };
+        if (options.pool) {
+            context->scan_tasks.push_back(options.pool->Submit(std::move(task)));
+        } else {
+            context->scan_tasks.push_back(std::async(std::launch::deferred, std::move(task)));
+        }
+
+        DLOG(INFO) << "Queued non-interleaved scan\n\n";
+        return;
+    }
 
     // here we start huffman decoding
 
-    auto mcu_it = context->GetMCUBeginIterator(std::move(channel_dc), std::move(channel_ac));
+    size_t scale = options.scale_denominator;
+    size_t scan_start = reader.BytePosition();
+    size_t scan_size = reader.ByteSize() - scan_start;
+    size_t mcu_rows = (context->height + context->mcu_height - 1) / context->mcu_height;
+    size_t first_mcu_row = options.first_row * scale / context->mcu_height;
+    size_t end_mcu_row =
+        std::min(mcu_rows, ((options.first_row + context->OutputHeight()) * scale +
+                            context->mcu_height - 1) / context->mcu_height);
+
+    std::vector<ScanBand> bands;
+    std::shared_ptr<ScanIndex> recorded;
+
+    if (const ScanIndex* index = options.scan_index.get()) {
+        size_t step = index->rows_per_checkpoint;
+        if (index->width != context->width || index->height != context->height ||
+            index->scan_size != scan_size || step == 0 || index->checkpoints.empty() ||
+            index->checkpoints.size() > (mcu_rows + step - 1) / step ||
+            index->checkpoints.front().dc_predictors.size() != scan_channels.size()) {
+            throw std::invalid_argument("Scan index does not match the picture");
+        }
+
+        // partial index covers top rows only, the band may start above it
+        size_t known = index->checkpoints.size();
+        size_t begin = std::min(first_mcu_row / step, known - 1) * step;
+        // resampling takes rows in order
+        if (options.pool && !context->resampler && (end_mcu_row - 1) / step < known) {
+            for (size_t row = begin; row < end_mcu_row; row += step) {
+                bands.push_back({row, std::min(row + step, end_mcu_row),
+                                 &index->checkpoints[row / step]});
+            }
+        } else {
+            bands.push_back({begin, end_mcu_row, &index->checkpoints[begin / step]});
+            if (options.index_rows == step && known < (mcu_rows + step - 1) / step &&
+                end_mcu_row >= known * step) {
+                recorded = std::make_shared<ScanIndex>(*index);  // extended by the band
+            }
+        }
+    } else {
+        bands.push_back({0, end_mcu_row, nullptr});
+        if (options.index_rows) {
+            recorded = std::make_shared<ScanIndex>();
+            *recorded = {context->width, context->height, scan_size, options.index_rows, {}};
+        }
+    }
 
-    while (!mcu_it.IsEnd()) {
-        DLOG_EVERY_N(INFO, 100) << "Processing " << google::COUNTER << "th MCU out of "
-                                << ((context->width + context->mcu_width - 1) /
-                                    context->mcu_width) *
-                                       ((context->height + context->mcu_height - 1) /
-                                        context->mcu_height);
+    std::vector<DecodeStatus> results;
+
+    if (bands.size() == 1) {
+        results.push_back(DecodeBand(reader, scan_start, std::move(scan_channels), bands.front(),
+                                     restarts, context, recorded.get()));
+    } else {
+        std::vector<std::future<DecodeStatus>> futures;
+        for (const ScanBand& band : bands) {
+            futures.push_back(options.pool->Submit([&, band] {
+                return DecodeBand(reader, scan_start, scan_channels, band, restarts, context,
+                                  nullptr);
+            }));
+        }
 
-        mcu_it.Process(reader);
+        results = WaitAll(futures);
+    }
 
-        ++mcu_it;
+    for (const DecodeStatus& result : results) {
+        context->AddStatus(result);
+    }
+    context->FinishImage();
+
+    if (context->status.complete) {
+        context->status.valid_rows = context->OutputHeight();
+        context->scan_index = recorded;
     }
 
     DLOG(INFO) << "Finished processing SOS section\n\n";
 }
 
+DecodeStatus SectionSOS::DecodeToStore(BitReader<std::vector<uint8_t>> reader,
+                                       std::vector<ScanChannel> scan_channels,
+                                       const std::vector<size_t>& restarts,
+                                       PictureContext* context, CoefficientStore* store) {
+    DecodeStatus status;
+    size_t max_h = context->mcu_width / kDataUnitSide;
+    size_t max_v = context->mcu_height / kDataUnitSide;
+    size_t mcu_columns = (context->width + context->mcu_width - 1) / context->mcu_width;
+    size_t mcu_rows = (context->height + context->mcu_height - 1) / context->mcu_height;
+
+    // sampling factors, data units of the channel in an MCU
+    std::vector<size_t> h, v;
+    for (const ScanChannel& scan_channel : scan_channels) {
+        const Channel& channel = context->channels[scan_channel.channel_id];
+        h.push_back(max_h / channel.horizontal_thinning);
+        v.push_back(max_v / channel.vertical_thinning);
+    }
+
+    // A single channel scan has MCUs of one data unit in raster order of the channel, only
+    // units inside its scaled size are coded. Other scans keep MCUs of the frame.
+    bool single = scan_channels.size() == 1;
+    size_t columns = mcu_columns, rows = mcu_rows;
+    if (single) {
+        size_t width = (context->width * h[0] + max_h - 1) / max_h;
+        size_t height = (context->height * v[0] + max_v - 1) / max_v;
+        columns = (width + kDataUnitSide - 1) / kDataUnitSide;
+        rows = (height + kDataUnitSide - 1) / kDataUnitSide;
+    }
+
+    // store keeps units of the channel per frame MCU, row by row
+    auto block_index = [&](size_t s, size_t row, size_t column, size_t unit) {
+        if (single) {
+            size_t mcu = (row / v[s]) * mcu_columns + column / h[s];
+            return mcu * h[s] * v[s] + (row % v[s]) * h[s] + column % h[s];
+        }
+        return (row * mcu_columns + column) * h[s] * v[s] + unit;
+    };
+
+    size_t restart_interval = context->restart_interval;
+    size_t scale = context->options.scale_denominator;
+    std::vector<int> previous_dcs(scan_channels.size(), 0);
+    std::array<int16_t, kDataUnitSize> zigzag;
+    bool skipping = false;  // tolerant mode: damaged interval, waiting for the next restart
+    uint64_t row_start = TraceNow();
+
+    for (size_t mcu = 0; mcu < rows * columns; ++mcu) {
+        size_t row = mcu / columns, column = mcu % columns;
+        if (mcu && column == 0) {
+            RecordTraceEvent("entropy row", row_start, "row", row - 1);
+            row_start = TraceNow();
+        }
+
+        try {
+            if (restart_interval && mcu && mcu % restart_interval == 0) {
+                size_t restart = mcu / restart_interval - 1;
+                if (restart >= restarts.size()) {
+                    throw std::invalid_argument("Restart marker is missing");
+                }
+
+                size_t position = restarts[restart];
+                if (!skipping && reader.BytePosition() > position) {
+                    throw std::invalid_argument("Scan data overlaps restart marker");
+                }
+
+                reader.SeekByte(position);  // skips padding bits
+                std::fill(previous_dcs.begin(), previous_dcs.end(), 0);
+                skipping = false;
+            }
+
+            StageTimer timer(DecodeStage::Entropy);
+            for (size_t s = 0; !skipping && s < scan_channels.size(); ++s) {
+                for (size_t unit = 0; unit < (single ? 1 : h[s] * v[s]); ++unit) {
+                    size_t end = DataUnit::ReadQuantized(reader, scan_channels[s], previous_dcs[s],
+                                                         zigzag.data());
+                    store->Put(scan_channels[s].channel_id, block_index(s, row, column, unit),
+                               zigzag.data(), end);
+                }
+            }
+        } catch (const LimitExceededError&) {
+            throw;
+        } catch (const std::exception& e) {
+            if (!context->options.tolerant) {
+                throw;
+            }
+
+            if (status.complete) {
+                size_t picture_row = (single ? row / v[0] : row) * context->mcu_height / scale;
+                DLOG(INFO) << "Scan is damaged at row " << picture_row << ": " << e.what();
+                status.complete = false;
+                status.error = e.what();
+                status.valid_rows =
+                    picture_row - std::min(picture_row, context->options.first_row);
+            }
+            if (!single && !skipping) {
+                for (size_t s = 0; s < scan_channels.size(); ++s) {
+                    store->Erase(scan_channels[s].channel_id, block_index(s, row, column, 0),
+                                 h[s] * v[s]);
+                }
+            }
+            skipping = true;
+        }
+
+        if (skipping) {
+            ++status.damaged_mcus;
+        }
+
+        context->CountMCU();
+    }
+    RecordTraceEvent("entropy row", row_start, "row", rows - 1);
+
+    return status;
+}
+
 void SectionDQT::Process(BitReader<std::vector<uint8_t>>& reader, PictureContext* context) {
     DLOG(INFO) << "Started processing DQT section";
 
@@ -256,23 +687,23 @@ void SectionDQT::Process(BitReader<std::vector<uint8_t>>& reader, PictureContext
         ++value_sz;
         uint8_t qt_id = reader.ReadHalfByte();
 
+        if (value_sz > 2) {
+            throw std::invalid_argument("QT value size must be 1 or 2 bytes");
+        }
+
         DLOG(INFO) << "QTable #" << static_cast<size_t>(qt_id)
                    << ", value size: " << static_cast<size_t>(value_sz) << ", section size: " << sz;
 
-        auto [it, inserted] = context->qts.emplace(qt_id, kDataUnitSide * kDataUnitSide);
-        if (!inserted) {
+        if (context->qts.contains(qt_id)) {
             throw std::invalid_argument("Overriding existing QT, id: " + std::to_string(qt_id));
         }
 
-        auto& table = it->second;
-        DiagonalUnitIterator read_iter;
-
-        while (!read_iter.IsEnd()) {
-            auto [i, j] = read_iter.Get();
-            table[i * kDataUnitSide + j] =
-                (value_sz == 2) ? reader.ReadDoubleByte() : reader.ReadByte();
-            read_iter.Proceed();
+        std::array<uint16_t, kDataUnitSize> table;
+        for (uint8_t pos : kZigzagOrder) {
+            table[pos] = (value_sz == 2) ? reader.ReadDoubleByte() : reader.ReadByte();
         }
+
+        context->qts[qt_id] = TableCache::Instance().GetQuantTable(table);
     }
 
     DLOG(INFO) << "Finished processing DQT section\n\n";
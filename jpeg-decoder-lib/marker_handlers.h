@@ -37,6 +37,10 @@ private:
 };
 
 class SectionAPP final : public MarkerHandler {
+    /*
+            Application sections without own handler, only JFIF extension
+            with JPEG thumbnail (JFXX) is looked into.
+    */
 public:
     constexpr static inline size_t kLimitOccurence = std::numeric_limits<size_t>::max();
 
@@ -44,10 +48,48 @@ public:
     }
 
 private:
-    virtual void Process(BitReader<std::vector<uint8_t>>& /*reader*/, PictureContext* /*context*/
-                         ) override {
-        // chill
+    virtual void Process(BitReader<std::vector<uint8_t>>& reader, PictureContext* context) override;
+};
+
+class SectionAPP1 final : public MarkerHandler {
+    /*
+            EXIF metadata, its JPEG thumbnail is kept in the context.
+            Malformed EXIF is ignored, it does not affect the picture.
+    */
+public:
+    constexpr static inline size_t kLimitOccurence = std::numeric_limits<size_t>::max();
+
+    SectionAPP1() : MarkerHandler(kLimitOccurence) {
     }
+
+private:
+    virtual void Process(BitReader<std::vector<uint8_t>>& reader, PictureContext* context) override;
+};
+
+class SectionAPP14 final : public MarkerHandler {
+    /*
+            Adobe marker, the only APP section affecting decoding:
+            its transform flag tells how 3 and 4 channel pictures are color coded.
+    */
+public:
+    constexpr static inline size_t kLimitOccurence = std::numeric_limits<size_t>::max();
+
+    SectionAPP14() : MarkerHandler(kLimitOccurence) {
+    }
+
+private:
+    virtual void Process(BitReader<std::vector<uint8_t>>& reader, PictureContext* context) override;
+};
+
+class SectionDRI final : public MarkerHandler {
+public:
+    constexpr static inline size_t kLimitOccurence = std::numeric_limits<size_t>::max();
+
+    SectionDRI() : MarkerHandler(kLimitOccurence) {
+    }
+
+private:
+    virtual void Process(BitReader<std::vector<uint8_t>>& reader, PictureContext* context) override;
 };
 
 class SectionDHT final : public MarkerHandler {
@@ -84,23 +126,42 @@ private:
 };
 
 class SectionSOF0 final : public MarkerHandler {
+    /*
+            Frame header of baseline (SOF0) or, if |extended|, extended sequential
+            Huffman (SOF1) pictures. The latter may have 12-bit samples, which are
+            reconstructed on the same path and returned up to 4095.
+    */
 public:
     constexpr static inline size_t kLimitOccurence = 1;
 
-    SectionSOF0() : MarkerHandler(kLimitOccurence) {
+    explicit SectionSOF0(bool extended) : MarkerHandler(kLimitOccurence), extended_(extended) {
     }
 
 private:
     virtual void Process(BitReader<std::vector<uint8_t>>& reader, PictureContext* context) override;
+
+private:
+    bool extended_;
 };
 
 class SectionSOS final : public MarkerHandler {
+    /*
+            Baseline scan. A scan of all channels is decoded right away. Non-interleaved
+            scans, each with a part of the channels, are entropy decoded to coefficients,
+            on the pool concurrently, and reconstructed by PictureContext::FinishScans.
+    */
 public:
-    constexpr static inline size_t kLimitOccurence = 1;
+    constexpr static inline size_t kLimitOccurence = 4;  // a scan per channel at most
 
     SectionSOS() : MarkerHandler(kLimitOccurence) {
     }
 
 private:
     virtual void Process(BitReader<std::vector<uint8_t>>& reader, PictureContext* context) override;
+
+    // Entropy decodes scan of a part of the channels into |store|.
+    static DecodeStatus DecodeToStore(BitReader<std::vector<uint8_t>> reader,
+                                      std::vector<ScanChannel> scan_channels,
+                                      const std::vector<size_t>& restarts,
+                                      PictureContext* context, CoefficientStore* store);
 };
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+#include "utils/image.h"
+
+class BufferPool;
+struct ScanIndex;
+class ThreadPool;
+
+struct DecodeLimits {
+    /*
+            Resource bounds for untrusted input, zero means unlimited.
+            Limits are checked before the corresponding allocation or work is done.
+    */
+    size_t max_pixels = 0;
+    size_t max_memory = 0;      // bytes of buffered sections plus output image
+    size_t max_scan_bytes = 0;  // entropy coded data of all scans
+    size_t max_mcus = 0;
+    std::chrono::milliseconds max_time{0};
+};
+
+// Thrown when input is valid, but decoding it would exceed DecodeLimits.
+class LimitExceededError : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+enum class IdctPrecision {
+    Float,   // single precision FFTW, half the memory traffic
+    Double,  // reference path with FFTW double precision accuracy
+};
+
+enum class ResizeFilter {
+    Box,       // average of covered pixels
+    Bilinear,  // triangle, stretched over the covered pixels when downscaling
+    Lanczos3,
+};
+
+struct DecodeOptions {
+    // Gray formats skip IDCT and color conversion of chroma channels entirely,
+    // grayscale and YCbCr pictures are written straight from the luma channel.
+    // 12-bit pictures need RGB or 16-bit formats, samples go up to 4095.
+    PixelFormat output_format = PixelFormat::RGB;
+    IdctPrecision idct_precision = IdctPrecision::Float;
+    // 1, 2, 4 or 8: IDCT reconstructs only low frequencies of each data unit
+    // and the image is that many times smaller (rounding up) than the picture.
+    size_t scale_denominator = 1;
+    DecodeLimits limits;
+    // Band of image rows to decode, zero count means up to the bottom. Rows above the band
+    // are entropy decoded only, or skipped entirely starting from a scan index checkpoint.
+    size_t first_row = 0;
+    size_t row_count = 0;
+    // Columns of the band likewise, all MCU columns are still entropy decoded.
+    size_t first_column = 0;
+    size_t column_count = 0;
+    // Decodes record a scan index checkpoint every index_rows MCU rows they pass, see
+    // Decoder::GetScanIndex. An index given back lets later decodes start near the
+    // requested band and, with a pool, decode bands between checkpoints in parallel.
+    // A band below a partial index extends it when index_rows matches its step.
+    size_t index_rows = 0;
+    std::shared_ptr<const ScanIndex> scan_index;
+    ThreadPool* pool = nullptr;  // must not be the pool running the decode itself
+    // Output images take their memory from the pool and give it back when the image is
+    // gone, so decodes under load reuse faulted-in pages. Copies of such images take
+    // memory of their own. Not used by DecodeInto.
+    BufferPool* buffer_pool = nullptr;
+    // Tolerant mode returns the decoded part of truncated or corrupted scans instead of
+    // throwing: damaged MCUs are filled with gray, decoding resumes at the next restart marker.
+    bool tolerant = false;
+    // Writes pixels rotated or mirrored as the EXIF orientation tag says, so the image comes
+    // out upright. Bands and crops still select rows and columns of the stored picture.
+    bool apply_orientation = false;
+    // Exact size of the returned image, zero for one of them keeps the aspect ratio.
+    // Rows are resampled as their MCU row completes, through a ring of filtered rows, so
+    // the image is never held at the decoded size. Full picture decodes also pick the
+    // largest scale_denominator still at least as large as the target. Bands are resized
+    // from the given scale, valid_rows counts their rows before resizing.
+    size_t output_width = 0;
+    size_t output_height = 0;
+    ResizeFilter resize_filter = ResizeFilter::Lanczos3;
+};
+
+struct DecodeStatus {
+    bool complete = true;     // every MCU decoded without errors
+    bool truncated = false;   // input ended inside scan data
+    size_t valid_rows = 0;    // rows from the top decoded without errors
+    size_t damaged_mcus = 0;  // MCUs filled with gray
+    std::string error;        // first error met in tolerant mode
+};
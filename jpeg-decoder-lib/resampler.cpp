@@ -0,0 +1,174 @@
+#include "resampler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <numbers>
+#include <stdexcept>
+
+namespace {
+
+// Filter reach in source pixels at 1:1 scale.
+double Support(ResizeFilter filter) {
+    switch (filter) {
+        case ResizeFilter::Box:
+            return 0.5;
+        case ResizeFilter::Bilinear:
+            return 1.0;
+        case ResizeFilter::Lanczos3:
+            return 3.0;
+    }
+    throw std::logic_error("Unknown resize filter");
+}
+
+double Sinc(double x) {
+    if (x == 0.0) {
+        return 1.0;
+    }
+    x *= std::numbers::pi;
+    return std::sin(x) / x;
+}
+
+double Weight(ResizeFilter filter, double x) {
+    switch (filter) {
+        case ResizeFilter::Box:
+            return (x > -0.5 && x <= 0.5) ? 1.0 : 0.0;
+        case ResizeFilter::Bilinear:
+            return std::max(0.0, 1.0 - std::abs(x));
+        case ResizeFilter::Lanczos3:
+            return (std::abs(x) < 3.0) ? Sinc(x) * Sinc(x / 3.0) : 0.0;
+    }
+    throw std::logic_error("Unknown resize filter");
+}
+
+}  // namespace
+
+Resampler::Resampler(size_t width, size_t height, size_t strip_rows, size_t output_width,
+                     size_t output_height, ResizeFilter filter, int max_value, Image* output,
+                     const Placement& placement)
+    : height_(height),
+      channels_(Image::IsGray(output->Format()) ? 1 : 3),
+      max_value_(max_value),
+      columns_(ComputeTaps(width, output_width, filter)),
+      rows_(ComputeTaps(height, output_height, filter)),
+      line_(output_width * channels_),
+      strip_(width, strip_rows, channels_ == 1 ? PixelFormat::Gray16 : PixelFormat::RGB),
+      output_(output),
+      placement_(placement) {
+    size_t span = 0;
+    for (const Taps& taps : rows_) {
+        span = std::max(span, taps.weights.size());
+    }
+    ring_.assign(span, std::vector<float>(output_width * channels_));
+}
+
+std::vector<Resampler::Taps> Resampler::ComputeTaps(size_t size, size_t output_size,
+                                                    ResizeFilter filter) {
+    // downscaling stretches the filter over the source pixels an output pixel covers
+    double ratio = static_cast<double>(size) / output_size;
+    double stretch = std::max(ratio, 1.0);
+    double support = Support(filter) * stretch;
+
+    std::vector<Taps> result(output_size);
+    for (size_t i = 0; i < output_size; ++i) {
+        double center = (i + 0.5) * ratio;
+        size_t first = std::max(0.0, std::floor(center - support + 0.5));
+        size_t end = std::min<double>(size, std::floor(center + support + 0.5));
+
+        Taps& taps = result[i];
+        taps.first = first;
+        double sum = 0;
+        for (size_t j = first; j < end; ++j) {
+            taps.weights.push_back(Weight(filter, (j + 0.5 - center) / stretch));
+            sum += taps.weights.back();
+        }
+
+        if (sum == 0) {
+            // no pixel center inside a box narrower than a pixel: nearest one
+            taps.first = std::min<size_t>(center, size - 1);
+            taps.weights.assign(1, 1.0f);
+            continue;
+        }
+        for (float& weight : taps.weights) {
+            weight /= sum;
+        }
+    }
+    return result;
+}
+
+Image& Resampler::Strip() {
+    return strip_;
+}
+
+void Resampler::PushRows(size_t begin, size_t end) {
+    for (size_t row = begin; row < end && received_ < height_; ++row) {
+        float* filtered = ring_[received_ % ring_.size()].data();
+
+        for (size_t column = 0; column < columns_.size(); ++column) {
+            const Taps& taps = columns_[column];
+            float* pixel = filtered + column * channels_;
+            std::fill(pixel, pixel + channels_, 0.0f);
+
+            if (channels_ == 1) {
+                const uint16_t* source = strip_.GetRow16(row) + taps.first;
+                for (size_t k = 0; k < taps.weights.size(); ++k) {
+                    pixel[0] += taps.weights[k] * source[k];
+                }
+            } else {
+                const RGB* source = strip_.GetRow(row) + taps.first;
+                for (size_t k = 0; k < taps.weights.size(); ++k) {
+                    pixel[0] += taps.weights[k] * source[k].r;
+                    pixel[1] += taps.weights[k] * source[k].g;
+                    pixel[2] += taps.weights[k] * source[k].b;
+                }
+            }
+        }
+
+        ++received_;
+        Emit();
+    }
+}
+
+void Resampler::Finish() {
+    while (received_ < height_) {
+        std::vector<float>& filtered = ring_[received_ % ring_.size()];
+        std::fill(filtered.begin(), filtered.end(), 0.0f);
+        ++received_;
+        Emit();
+    }
+}
+
+void Resampler::Emit() {
+    auto clamp = [&](float value) {
+        return static_cast<int>(std::clamp(std::round(value), 0.0f, float(max_value_)));
+    };
+
+    for (; emitted_ < rows_.size(); ++emitted_) {
+        const Taps& taps = rows_[emitted_];
+        if (taps.first + taps.weights.size() > received_) {
+            return;
+        }
+
+        std::fill(line_.begin(), line_.end(), 0.0f);
+        for (size_t k = 0; k < taps.weights.size(); ++k) {
+            const std::vector<float>& filtered = ring_[(taps.first + k) % ring_.size()];
+            for (size_t i = 0; i < line_.size(); ++i) {
+                line_[i] += taps.weights[k] * filtered[i];
+            }
+        }
+
+        size_t row = emitted_;
+        for (size_t column = 0; column < columns_.size(); ++column) {
+            size_t img_row = row * placement_.row_by_row + column * placement_.row_by_column +
+                             placement_.row0;
+            size_t img_col = row * placement_.column_by_row +
+                             column * placement_.column_by_column + placement_.column0;
+            const float* pixel = line_.data() + column * channels_;
+            if (channels_ == 1) {
+                output_->SetGray(img_row, img_col, clamp(pixel[0]));
+            } else {
+                output_->SetPixel(img_row, img_col,
+                                  {clamp(pixel[0]), clamp(pixel[1]), clamp(pixel[2])});
+            }
+        }
+    }
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+#include "context.h"
+#include "options.h"
+#include "utils/image.h"
+
+class Resampler {
+    /*
+            Separable resize of rows arriving top to bottom. Decoded rows are put
+            in a strip of one MCU row, each is filtered horizontally into a ring
+            holding as many rows as the vertical filter spans, and an output row
+            is written as soon as its last tap has arrived.
+    */
+public:
+    // |output| is allocated by the caller, output pixel (row, column) goes where
+    // |placement| maps it.
+    Resampler(size_t width, size_t height, size_t strip_rows, size_t output_width,
+              size_t output_height, ResizeFilter filter, int max_value, Image* output,
+              const Placement& placement);
+
+    // Rows of the band are written here before they are pushed.
+    Image& Strip();
+
+    // Takes strip rows [begin, end) as the next rows of the band.
+    void PushRows(size_t begin, size_t end);
+
+    // Completes output with black rows in place of band rows that never came.
+    void Finish();
+
+private:
+    struct Taps {
+        size_t first;  // source pixel of the first weight
+        std::vector<float> weights;
+    };
+
+    static std::vector<Taps> ComputeTaps(size_t size, size_t output_size, ResizeFilter filter);
+
+    // Writes output rows whose taps are all in the ring.
+    void Emit();
+
+private:
+    size_t height_;
+    size_t channels_;
+    int max_value_;
+    std::vector<Taps> columns_;  // horizontal taps of each output column
+    std::vector<Taps> rows_;     // vertical taps of each output row
+    std::vector<std::vector<float>> ring_;  // filtered row y is at y % size
+    std::vector<float> line_;
+    size_t received_ = 0;
+    size_t emitted_ = 0;
+    Image strip_;
+    Image* output_;
+    Placement placement_;
+};
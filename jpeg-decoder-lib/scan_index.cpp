@@ -0,0 +1,161 @@
+#include "scan_index.h"
+
+#include <limits>
+#include <stdexcept>
+#include <string_view>
+
+namespace {
+
+constexpr std::string_view kMagic = "JDSI";
+constexpr uint8_t kVersion = 1;
+
+void PutVarint(std::vector<uint8_t>& out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<uint8_t>(value) | 0x80);
+        value >>= 7;
+    }
+    out.push_back(static_cast<uint8_t>(value));
+}
+
+void PutSigned(std::vector<uint8_t>& out, int64_t value) {
+    // zigzag, small magnitudes of both signs take one byte
+    PutVarint(out, (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63));
+}
+
+class Reader {
+public:
+    explicit Reader(const std::vector<uint8_t>& data) : data_(data) {
+    }
+
+    uint8_t Byte() {
+        if (position_ == data_.size()) {
+            throw std::invalid_argument("Scan index is truncated");
+        }
+        return data_[position_++];
+    }
+
+    uint64_t Varint() {
+        uint64_t result = 0;
+        for (size_t shift = 0; shift < 64; shift += 7) {
+            uint8_t byte = Byte();
+            result |= static_cast<uint64_t>(byte & 0x7f) << shift;
+            if (!(byte & 0x80)) {
+                return result;
+            }
+        }
+        throw std::invalid_argument("Scan index varint is too long");
+    }
+
+    int64_t Signed() {
+        uint64_t value = Varint();
+        return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+    }
+
+    bool IsEnd() const {
+        return position_ == data_.size();
+    }
+
+    size_t Remaining() const {
+        return data_.size() - position_;
+    }
+
+private:
+    const std::vector<uint8_t>& data_;
+    size_t position_ = 0;
+};
+
+}  // namespace
+
+std::vector<uint8_t> ScanIndex::Serialize() const {
+    std::vector<uint8_t> result(kMagic.begin(), kMagic.end());
+    result.push_back(kVersion);
+
+    size_t channels = checkpoints.empty() ? 0 : checkpoints.front().dc_predictors.size();
+
+    PutVarint(result, width);
+    PutVarint(result, height);
+    PutVarint(result, scan_size);
+    PutVarint(result, rows_per_checkpoint);
+    PutVarint(result, channels);
+    PutVarint(result, checkpoints.size());
+
+    const ScanCheckpoint* previous = nullptr;
+    for (const auto& checkpoint : checkpoints) {
+        if (checkpoint.dc_predictors.size() != channels) {
+            throw std::invalid_argument("Scan index checkpoints differ in channel count");
+        }
+
+        PutVarint(result, checkpoint.bit_position - (previous ? previous->bit_position : 0));
+        for (size_t i = 0; i < channels; ++i) {
+            PutSigned(result, int64_t{checkpoint.dc_predictors[i]} -
+                                  (previous ? previous->dc_predictors[i] : 0));
+        }
+        previous = &checkpoint;
+    }
+
+    return result;
+}
+
+ScanIndex ScanIndex::Deserialize(const std::vector<uint8_t>& data) {
+    Reader reader(data);
+
+    for (char symbol : kMagic) {
+        if (reader.Byte() != static_cast<uint8_t>(symbol)) {
+            throw std::invalid_argument("Not a scan index");
+        }
+    }
+    if (reader.Byte() != kVersion) {
+        throw std::invalid_argument("Unsupported scan index version");
+    }
+
+    ScanIndex result;
+    result.width = reader.Varint();
+    result.height = reader.Varint();
+    result.scan_size = reader.Varint();
+    result.rows_per_checkpoint = reader.Varint();
+    size_t channels = reader.Varint();
+    size_t count = reader.Varint();
+
+    // every checkpoint takes at least a byte per varint, so the count can not promise
+    // more of them than the data holds
+    if (result.rows_per_checkpoint == 0 || channels == 0 || channels > 4 ||
+        count > result.height || count > reader.Remaining() / (1 + channels) ||
+        result.scan_size > std::numeric_limits<size_t>::max() / 8) {
+        throw std::invalid_argument("Scan index header is corrupted");
+    }
+
+    result.checkpoints.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        const ScanCheckpoint* previous = i > 0 ? &result.checkpoints.back() : nullptr;
+        ScanCheckpoint checkpoint{reader.Varint(), std::vector<int>(channels)};
+        if (previous) {
+            if (checkpoint.bit_position > result.scan_size * 8 - previous->bit_position) {
+                throw std::invalid_argument("Scan index checkpoint is out of scan");
+            }
+            checkpoint.bit_position += previous->bit_position;
+        }
+        if (checkpoint.bit_position > result.scan_size * 8) {
+            throw std::invalid_argument("Scan index checkpoint is out of scan");
+        }
+
+        for (size_t j = 0; j < channels; ++j) {
+            int64_t delta = reader.Signed();
+            int64_t base = previous ? previous->dc_predictors[j] : 0;
+            // deltas between int predictors are under 2^32, bounding them keeps the sum exact
+            if (delta <= -(int64_t{1} << 32) || delta >= (int64_t{1} << 32) ||
+                base + delta < std::numeric_limits<int>::min() ||
+                base + delta > std::numeric_limits<int>::max()) {
+                throw std::invalid_argument("Scan index DC predictor is out of range");
+            }
+            checkpoint.dc_predictors[j] = static_cast<int>(base + delta);
+        }
+
+        result.checkpoints.push_back(std::move(checkpoint));
+    }
+
+    if (!reader.IsEnd()) {
+        throw std::invalid_argument("Scan index has trailing data");
+    }
+
+    return result;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+struct ScanCheckpoint {
+    size_t bit_position;             // in entropy coded data, counted from the scan start
+    std::vector<int> dc_predictors;  // per scan channel, in scan order
+};
+
+struct ScanIndex {
+    /*
+            Decoder state at the start of every rows_per_checkpoint-th MCU row
+            of a baseline scan. With it the scan can be decoded from any
+            checkpoint, so row bands are decoded without the rows above them.
+            Band decodes build partial indexes, covering the top rows only.
+    */
+    size_t width = 0;  // of the picture the index was built for
+    size_t height = 0;
+    size_t scan_size = 0;  // bytes of entropy coded data
+    size_t rows_per_checkpoint = 0;
+    std::vector<ScanCheckpoint> checkpoints;  // i-th is at MCU row i * rows_per_checkpoint
+
+    // Compact sidecar representation, positions and predictors are delta coded varints.
+    std::vector<uint8_t> Serialize() const;
+
+    // Throws std::invalid_argument on malformed data.
+    static ScanIndex Deserialize(const std::vector<uint8_t>& data);
+};
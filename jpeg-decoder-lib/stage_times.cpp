@@ -0,0 +1,44 @@
+#include "stage_times.h"
+
+#include <atomic>
+
+namespace {
+
+std::array<std::atomic<uint64_t>, kDecodeStages> stage_nanoseconds;
+std::atomic<bool> stage_times_enabled = false;
+
+}  // namespace
+
+std::array<uint64_t, kDecodeStages> GetStageTimes() {
+    std::array<uint64_t, kDecodeStages> result;
+    for (size_t i = 0; i < kDecodeStages; ++i) {
+        result[i] = stage_nanoseconds[i].load(std::memory_order_relaxed);
+    }
+    return result;
+}
+
+void ResetStageTimes() {
+    for (auto& nanoseconds : stage_nanoseconds) {
+        nanoseconds.store(0, std::memory_order_relaxed);
+    }
+}
+
+void EnableStageTimes(bool enabled) {
+    stage_times_enabled.store(enabled, std::memory_order_relaxed);
+}
+
+bool StageTimesEnabled() {
+    return stage_times_enabled.load(std::memory_order_relaxed);
+}
+
+#ifdef JPEG_DECODER_STAGE_TIMES
+StageTimer::~StageTimer() {
+    if (start_ == std::chrono::steady_clock::time_point()) {
+        return;
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start_;
+    stage_nanoseconds[static_cast<size_t>(stage_)].fetch_add(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count(),
+        std::memory_order_relaxed);
+}
+#endif
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+enum class DecodeStage {
+    Entropy,  // Huffman decoding and dequantization of data units
+    Idct,     // inverse DCT and level shift of MCU rows
+    Color,    // upsampling, color conversion and writing to the image
+};
+
+constexpr size_t kDecodeStages = 3;
+
+// Nanoseconds spent in each stage by all threads since the last reset. Collected only
+// when the library is built with JPEG_DECODER_STAGE_TIMES and timers are enabled,
+// zeros otherwise.
+std::array<uint64_t, kDecodeStages> GetStageTimes();
+void ResetStageTimes();
+
+// Timers are off by default, so that decodes being measured pay only a flag check.
+void EnableStageTimes(bool enabled);
+bool StageTimesEnabled();
+
+// Adds the time of its scope to |stage| if timers are enabled when it starts.
+class StageTimer {
+public:
+#ifdef JPEG_DECODER_STAGE_TIMES
+    explicit StageTimer(DecodeStage stage) : stage_(stage) {
+        if (StageTimesEnabled()) {
+            start_ = std::chrono::steady_clock::now();
+        }
+    }
+    ~StageTimer();
+
+private:
+    DecodeStage stage_;
+    std::chrono::steady_clock::time_point start_;  // epoch if disabled
+#else
+    explicit StageTimer(DecodeStage) {
+    }
+#endif
+};
@@ -0,0 +1,115 @@
+#include "stream_decoder.h"
+
+#include <glog/logging.h>
+#include <exception>
+
+#include "standard_tables.h"
+#include "table_cache.h"
+
+namespace {
+
+template <size_t Bits, size_t Values>
+HuffmanTree StandardTree(const std::array<uint8_t, Bits>& code_lengths,
+                         const std::array<uint8_t, Values>& values) {
+    return TableCache::Instance().GetHuffmanTree({code_lengths.begin(), code_lengths.end()},
+                                                 {values.begin(), values.end()});
+}
+
+}  // namespace
+
+StreamDecoder::StreamDecoder(std::istream& input, const DecodeOptions& options, size_t threads)
+    : input_(&input), options_(options), pool_(threads) {
+    // ids used by MJPEG encoders: 0 for luma, 1 for chroma
+    tables_.dc_huffman_trees[0] =
+        StandardTree(annex_k::kDcLuminanceBits, annex_k::kDcLuminanceValues);
+    tables_.dc_huffman_trees[1] =
+        StandardTree(annex_k::kDcChrominanceBits, annex_k::kDcChrominanceValues);
+    tables_.ac_huffman_trees[0] =
+        StandardTree(annex_k::kAcLuminanceBits, annex_k::kAcLuminanceValues);
+    tables_.ac_huffman_trees[1] =
+        StandardTree(annex_k::kAcChrominanceBits, annex_k::kAcChrominanceValues);
+}
+
+std::optional<Image> StreamDecoder::Next() {
+    Refill();
+
+    if (frames_.empty()) {
+        return std::nullopt;
+    }
+
+    std::unique_ptr<Frame> frame = std::move(frames_.front());
+    frames_.pop_front();
+
+    status_ = {};
+    frame->done.get();  // rethrows errors of the frame
+
+    status_ = frame->context.status;
+    return std::move(frame->context.image);
+}
+
+const DecodeStatus& StreamDecoder::GetStatus() const {
+    return status_;
+}
+
+void StreamDecoder::Refill() {
+    while (!input_ended_ && frames_.size() < pool_.Size()) {
+        if (!SkipToFrame()) {
+            input_ended_ = true;
+            break;
+        }
+
+        auto frame = std::make_unique<Frame>();
+        frame->context.options = options_;
+        frame->context.decode_start = std::chrono::steady_clock::now();
+        frame->controller = std::make_unique<MarkerController>(input_, &frame->context);
+
+        try {
+            frame->controller->Separate();
+            frame->controller->ProcessHeaders();
+            InheritTables(&frame->context);
+
+            Frame* raw = frame.get();
+            frame->done = pool_.Submit([raw] { raw->controller->ProcessScans(); });
+        } catch (...) {
+            // delivered in order, next frame is looked for after the broken one
+            DLOG(INFO) << "Frame is broken, resynchronizing on next SOI";
+            std::promise<void> failed;
+            failed.set_exception(std::current_exception());
+            frame->done = failed.get_future();
+            input_->clear(input_->rdstate() & ~std::ios::failbit);
+        }
+
+        frames_.push_back(std::move(frame));
+    }
+}
+
+bool StreamDecoder::SkipToFrame() {
+    constexpr int kMarkerPrefix = 0xFF;
+    constexpr int kSOI = 0xD8;
+
+    while (true) {
+        int byte = input_->get();
+        if (byte == std::istream::traits_type::eof()) {
+            return false;
+        }
+        if (byte == kMarkerPrefix && input_->peek() == kSOI) {
+            input_->unget();
+            return true;
+        }
+    }
+}
+
+void StreamDecoder::InheritTables(PictureContext* context) {
+    // tables defined by the frame replace inherited ones with the same id
+    for (const auto& [id, tree] : tables_.dc_huffman_trees) {
+        context->dc_huffman_trees.try_emplace(id, tree);
+    }
+    for (const auto& [id, tree] : tables_.ac_huffman_trees) {
+        context->ac_huffman_trees.try_emplace(id, tree);
+    }
+    for (const auto& [id, table] : tables_.qts) {
+        context->qts.try_emplace(id, table);
+    }
+
+    tables_ = {context->ac_huffman_trees, context->dc_huffman_trees, context->qts};
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstddef>
+#include <deque>
+#include <future>
+#include <istream>
+#include <memory>
+#include <optional>
+#include <unordered_map>
+
+#include "context.h"
+#include "marker_controller.h"
+#include "options.h"
+#include "thread_pool.h"
+#include "utils/image.h"
+
+class StreamDecoder {
+    /*
+            Decoder of concatenated SOI..EOI frames, e.g. Motion JPEG.
+            Frames may omit DHT and DQT: tables of missing ids are taken from
+            the previous frames, Huffman tables default to the Annex K ones.
+            Headers are parsed on the calling thread, scans of up to |threads|
+            frames are decoded on the pool, frames are returned in stream order.
+    */
+public:
+    // 0 threads picks hardware concurrency.
+    StreamDecoder(std::istream& input, const DecodeOptions& options = {}, size_t threads = 0);
+
+    // Next frame in stream order, std::nullopt at the end of input. Errors of a frame
+    // are thrown when the frame is reached, later frames can still be read.
+    std::optional<Image> Next();
+
+    // Outcome of the frame last returned by Next.
+    const DecodeStatus& GetStatus() const;
+
+private:
+    struct Frame {
+        PictureContext context;
+        std::unique_ptr<MarkerController> controller;
+        std::future<void> done;
+    };
+
+    struct Tables {
+        std::unordered_map<uint8_t, HuffmanTree> ac_huffman_trees;
+        std::unordered_map<uint8_t, HuffmanTree> dc_huffman_trees;
+        std::unordered_map<uint8_t, std::shared_ptr<const QuantTable>> qts;
+    };
+
+    // Starts decoding of frames until |threads| frames are in flight or input ends.
+    void Refill();
+
+    // Skips bytes preceding the next SOI, returns false at the end of input.
+    bool SkipToFrame();
+
+    // Completes frame tables with inherited ones and remembers the result for next frames.
+    void InheritTables(PictureContext* context);
+
+private:
+    std::istream* input_;
+    DecodeOptions options_;
+    Tables tables_;
+    std::deque<std::unique_ptr<Frame>> frames_;  // in stream order
+    DecodeStatus status_;
+    bool input_ended_ = false;
+    ThreadPool pool_;  // last, so workers stop before frames are destroyed
+};
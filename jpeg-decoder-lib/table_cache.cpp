@@ -0,0 +1,164 @@
+#include "table_cache.h"
+
+#include <glog/logging.h>
+#include <algorithm>
+#include <utility>
+
+#include "standard_tables.h"
+
+namespace {
+
+uint64_t Hash(const std::vector<uint8_t>& bytes) {
+    // FNV-1a
+    uint64_t result = 14695981039346656037ull;
+    for (uint8_t byte : bytes) {
+        result ^= byte;
+        result *= 1099511628211ull;
+    }
+    return result;
+}
+
+std::vector<uint8_t> HuffmanKey(const std::vector<uint8_t>& code_lengths,
+                                const std::vector<uint8_t>& values) {
+    std::vector<uint8_t> result(code_lengths);
+    result.resize(HuffmanTree::kMaxTreeDepth, 0);
+    result.insert(result.end(), values.begin(), values.end());
+    return result;
+}
+
+std::vector<uint8_t> QuantKey(const std::array<uint16_t, kDataUnitSize>& values) {
+    std::vector<uint8_t> result;
+    result.reserve(2 * kDataUnitSize);
+    for (uint16_t value : values) {
+        result.push_back(value >> kBitsInByte);
+        result.push_back(value & 0xff);
+    }
+    return result;
+}
+
+template <size_t N>
+std::vector<uint8_t> ToVector(const std::array<uint8_t, N>& table) {
+    return {table.begin(), table.end()};
+}
+
+}  // namespace
+
+TableCache& TableCache::Instance() {
+    static TableCache instance;
+    return instance;
+}
+
+TableCache::TableCache() {
+    auto pin_tree = [this](std::vector<uint8_t>&& code_lengths, std::vector<uint8_t>&& values) {
+        HuffmanTree tree;
+        tree.Build(code_lengths, values);
+        auto key = HuffmanKey(code_lengths, values);
+        uint64_t hash = Hash(key);
+        Insert(pinned_trees_, std::move(key), hash, tree);
+    };
+
+    pin_tree(ToVector(annex_k::kDcLuminanceBits), ToVector(annex_k::kDcLuminanceValues));
+    pin_tree(ToVector(annex_k::kDcChrominanceBits), ToVector(annex_k::kDcChrominanceValues));
+    pin_tree(ToVector(annex_k::kAcLuminanceBits), ToVector(annex_k::kAcLuminanceValues));
+    pin_tree(ToVector(annex_k::kAcChrominanceBits), ToVector(annex_k::kAcChrominanceValues));
+
+    for (const auto& values : {annex_k::kLuminanceQuant, annex_k::kChrominanceQuant}) {
+        auto key = QuantKey(values);
+        uint64_t hash = Hash(key);
+        Insert(pinned_quant_, std::move(key), hash,
+               std::shared_ptr<const QuantTable>(std::make_shared<QuantTable>(values)));
+    }
+}
+
+HuffmanTree TableCache::GetHuffmanTree(const std::vector<uint8_t>& code_lengths,
+                                       const std::vector<uint8_t>& values) {
+    auto key = HuffmanKey(code_lengths, values);
+    uint64_t hash = Hash(key);
+
+    {
+        std::lock_guard lock(mutex_);
+        if (const HuffmanTree* tree = Find(pinned_trees_, key, hash)) {
+            return *tree;
+        }
+        if (const HuffmanTree* tree = Find(trees_, key, hash)) {
+            return *tree;
+        }
+    }
+
+    // built outside of the lock, invalid tables throw and are not cached
+    HuffmanTree tree;
+    tree.Build(code_lengths, values);
+
+    std::lock_guard lock(mutex_);
+    if (!Find(trees_, key, hash)) {
+        Insert(trees_, std::move(key), hash, tree);
+        Evict(trees_);
+    }
+    return tree;
+}
+
+std::shared_ptr<const QuantTable> TableCache::GetQuantTable(
+    const std::array<uint16_t, kDataUnitSize>& values) {
+    auto key = QuantKey(values);
+    uint64_t hash = Hash(key);
+
+    {
+        std::lock_guard lock(mutex_);
+        if (const auto* table = Find(pinned_quant_, key, hash)) {
+            return *table;
+        }
+        if (const auto* table = Find(quant_, key, hash)) {
+            return *table;
+        }
+    }
+
+    std::shared_ptr<const QuantTable> table = std::make_shared<QuantTable>(values);
+
+    std::lock_guard lock(mutex_);
+    if (!Find(quant_, key, hash)) {
+        Insert(quant_, std::move(key), hash, table);
+        Evict(quant_);
+    }
+    return table;
+}
+
+void TableCache::SetCapacity(size_t capacity) {
+    std::lock_guard lock(mutex_);
+    capacity_ = capacity;
+    Evict(trees_);
+    Evict(quant_);
+}
+
+template <class T>
+const T* TableCache::Find(Lru<T>& lru, const std::vector<uint8_t>& key, uint64_t hash) {
+    auto [begin, end] = lru.index.equal_range(hash);
+    for (auto it = begin; it != end; ++it) {
+        if (it->second->key == key) {
+            lru.entries.splice(lru.entries.begin(), lru.entries, it->second);
+            return &it->second->table;
+        }
+    }
+    return nullptr;
+}
+
+template <class T>
+void TableCache::Insert(Lru<T>& lru, std::vector<uint8_t>&& key, uint64_t hash, const T& table) {
+    lru.entries.push_front({std::move(key), table});
+    lru.index.emplace(hash, lru.entries.begin());
+}
+
+template <class T>
+void TableCache::Evict(Lru<T>& lru) {
+    while (lru.entries.size() > capacity_) {
+        auto last = std::prev(lru.entries.end());
+        auto [begin, end] = lru.index.equal_range(Hash(last->key));
+        for (auto it = begin; it != end; ++it) {
+            if (it->second == last) {
+                lru.index.erase(it);
+                break;
+            }
+        }
+        lru.entries.pop_back();
+        DLOG(INFO) << "Evicted table from cache";
+    }
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "context.h"
+#include "huffman.h"
+
+class TableCache {
+    /*
+            Process-wide cache of built decode tables. Most images come from a few
+            encoders writing the same DHT and DQT payloads (often Annex K tables),
+            so trees and prescaled quantization tables are built once and shared.
+            Entries are keyed by the hash of the table bytes, compared in full on
+            lookup, and evicted in LRU order. Annex K tables are never evicted.
+    */
+public:
+    constexpr static inline size_t kDefaultCapacity = 64;  // of each table kind
+
+    static TableCache& Instance();
+
+    // Tree of DHT |code_lengths| and |values|. Copies of a tree share its immutable
+    // nodes, so the result is cheap to copy and independent from other users.
+    HuffmanTree GetHuffmanTree(const std::vector<uint8_t>& code_lengths,
+                               const std::vector<uint8_t>& values);
+
+    // Table of DQT values in natural order.
+    std::shared_ptr<const QuantTable> GetQuantTable(
+        const std::array<uint16_t, kDataUnitSize>& values);
+
+    // Evicts least recently used entries beyond |capacity|, 0 disables caching.
+    void SetCapacity(size_t capacity);
+
+private:
+    TableCache();
+
+    template <class T>
+    struct Entry {
+        std::vector<uint8_t> key;
+        T table;
+    };
+
+    template <class T>
+    struct Lru {
+        std::list<Entry<T>> entries;  // most recently used first
+        std::unordered_multimap<uint64_t, typename std::list<Entry<T>>::iterator> index;
+    };
+
+    template <class T>
+    const T* Find(Lru<T>& lru, const std::vector<uint8_t>& key, uint64_t hash);
+
+    template <class T>
+    void Insert(Lru<T>& lru, std::vector<uint8_t>&& key, uint64_t hash, const T& table);
+
+    template <class T>
+    void Evict(Lru<T>& lru);
+
+private:
+    std::mutex mutex_;
+    size_t capacity_ = kDefaultCapacity;
+    Lru<HuffmanTree> pinned_trees_;  // Annex K, not limited by capacity
+    Lru<HuffmanTree> trees_;
+    Lru<std::shared_ptr<const QuantTable>> pinned_quant_;
+    Lru<std::shared_ptr<const QuantTable>> quant_;
+};
@@ -0,0 +1,60 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+
+#include "trace.h"
+
+ThreadPool::ThreadPool(size_t threads) {
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    workers_.reserve(threads);
+    for (size_t i = 0; i < threads; ++i) {
+        workers_.emplace_back([this] { Work(); });
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard lock(mutex_);
+        stopping_ = true;
+    }
+    has_tasks_.notify_all();
+
+    for (auto& worker : workers_) {
+        worker.join();
+    }
+}
+
+size_t ThreadPool::Size() const {
+    return workers_.size();
+}
+
+void ThreadPool::Push(std::function<void()>&& task) {
+    {
+        std::lock_guard lock(mutex_);
+        tasks_.push_back({std::move(task), TraceNow()});
+    }
+    has_tasks_.notify_one();
+}
+
+void ThreadPool::Work() {
+    while (true) {
+        Task task;
+        {
+            std::unique_lock lock(mutex_);
+            has_tasks_.wait(lock, [this] { return stopping_ || !tasks_.empty(); });
+            if (tasks_.empty()) {
+                return;  // stopping and nothing left
+            }
+            task = std::move(tasks_.front());
+            tasks_.pop_front();
+        }
+
+        uint64_t start = TraceNow();
+        int64_t queued_us = (start && task.queued) ? (start - task.queued) / 1000 : 0;
+        TraceScope trace("pool task", "queued_us", queued_us);
+        task.run();
+    }
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+class ThreadPool {
+    /*
+            Fixed number of workers taking tasks in submission order.
+            Destructor runs the tasks already submitted and joins the workers.
+    */
+public:
+    // 0 threads picks hardware concurrency.
+    explicit ThreadPool(size_t threads = 0);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // Exceptions thrown by |task| are delivered through the future.
+    template <class F>
+    std::future<std::invoke_result_t<F>> Submit(F&& task) {
+        using Result = std::invoke_result_t<F>;
+        // std::function needs copyable callables
+        auto packaged = std::make_shared<std::packaged_task<Result()>>(std::forward<F>(task));
+        std::future<Result> result = packaged->get_future();
+        Push([packaged] { (*packaged)(); });
+        return result;
+    }
+
+    size_t Size() const;
+
+private:
+    void Push(std::function<void()>&& task);
+    void Work();
+
+private:
+    struct Task {
+        std::function<void()> run;
+        uint64_t queued = 0;  // TraceNow of Submit
+    };
+
+private:
+    std::mutex mutex_;
+    std::condition_variable has_tasks_;
+    std::deque<Task> tasks_;
+    bool stopping_ = false;
+    std::vector<std::thread> workers_;
+};
+
+// Waits for every future, so tasks referring to the caller's state are finished,
+// then rethrows the first exception met. Results are in submission order.
+template <class T>
+std::vector<T> WaitAll(std::vector<std::future<T>>& futures) {
+    std::vector<T> results;
+    std::exception_ptr error;
+    for (auto& future : futures) {
+        try {
+            results.push_back(future.get());
+        } catch (...) {
+            if (!error) {
+                error = std::current_exception();
+            }
+        }
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+    return results;
+}
+
+inline void WaitAll(std::vector<std::future<void>>& futures) {
+    std::exception_ptr error;
+    for (auto& future : futures) {
+        try {
+            future.get();
+        } catch (...) {
+            if (!error) {
+                error = std::current_exception();
+            }
+        }
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
@@ -0,0 +1,189 @@
+#include "trace.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace {
+
+struct Event {
+    const char* name;
+    const char* arg_name;
+    int64_t arg;
+    uint64_t start;
+    uint64_t end;
+};
+
+constexpr size_t kChunkEvents = 1024;
+
+struct Chunk {
+    std::array<Event, kChunkEvents> events;
+    std::atomic<size_t> count = 0;  // published events
+    std::atomic<Chunk*> next = nullptr;
+};
+
+// Events of one thread in a list of chunks. Only the owner appends, publishing each
+// event with a release store of the count, so the writer reads without locking.
+struct ThreadEvents {
+    ~ThreadEvents() {
+        for (Chunk* chunk = head.next.load(); chunk;) {
+            Chunk* next = chunk->next.load();
+            delete chunk;
+            chunk = next;
+        }
+    }
+
+    // Chunks stay allocated for the next trace.
+    void Reset(uint64_t trace) {
+        for (Chunk* chunk = &head; chunk; chunk = chunk->next.load(std::memory_order_relaxed)) {
+            chunk->count.store(0, std::memory_order_relaxed);
+        }
+        tail = &head;
+        generation.store(trace, std::memory_order_release);
+    }
+
+    void Append(const Event& event) {
+        size_t count = tail->count.load(std::memory_order_relaxed);
+        if (count == kChunkEvents) {
+            Chunk* next = tail->next.load(std::memory_order_relaxed);
+            if (!next) {
+                next = new Chunk;
+                tail->next.store(next, std::memory_order_release);
+            }
+            tail = next;
+            count = 0;
+        }
+        tail->events[count] = event;
+        tail->count.store(count + 1, std::memory_order_release);
+    }
+
+    size_t thread_id = 0;
+    std::atomic<uint64_t> generation = 0;  // trace the events belong to
+    std::atomic<bool> owned = true;        // false once the thread exits
+    Chunk head;
+    Chunk* tail = &head;
+};
+
+std::atomic<bool> tracing = false;
+std::atomic<uint64_t> trace_generation = 0;
+std::atomic<int64_t> trace_origin = 0;  // steady clock nanoseconds of StartTrace
+
+// Buffers of exited threads are kept for the trace and reused by new threads after it.
+std::mutex registry_mutex;
+std::vector<std::unique_ptr<ThreadEvents>> registry;
+
+int64_t ClockNanoseconds() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+class ThreadSlot {
+public:
+    ~ThreadSlot() {
+        if (events_) {
+            events_->owned.store(false, std::memory_order_release);
+        }
+    }
+
+    ThreadEvents& Get() {
+        if (!events_) {
+            events_ = Acquire();
+        }
+        return *events_;
+    }
+
+private:
+    static ThreadEvents* Acquire() {
+        std::lock_guard lock(registry_mutex);
+        uint64_t current = trace_generation.load();
+        for (auto& events : registry) {
+            if (!events->owned.load(std::memory_order_acquire) &&
+                events->generation.load() != current) {
+                events->owned.store(true);
+                return events.get();
+            }
+        }
+        registry.push_back(std::make_unique<ThreadEvents>());
+        registry.back()->thread_id = registry.size();
+        return registry.back().get();
+    }
+
+private:
+    ThreadEvents* events_ = nullptr;
+};
+
+}  // namespace
+
+void StartTrace() {
+    trace_origin.store(ClockNanoseconds());
+    trace_generation.fetch_add(1);
+    tracing.store(true);
+}
+
+void StopTrace() {
+    tracing.store(false);
+}
+
+void WriteTrace(std::ostream& output) {
+    std::lock_guard lock(registry_mutex);
+    uint64_t current = trace_generation.load();
+
+    output << "{\"traceEvents\":[";
+    const char* separator = "\n";
+    char buffer[256];
+    for (const auto& events : registry) {
+        if (events->generation.load(std::memory_order_acquire) != current) {
+            continue;
+        }
+        for (const Chunk* chunk = &events->head; chunk;
+             chunk = chunk->next.load(std::memory_order_acquire)) {
+            size_t count = chunk->count.load(std::memory_order_acquire);
+            for (size_t i = 0; i < count; ++i) {
+                const Event& event = chunk->events[i];
+                int length = std::snprintf(
+                    buffer, sizeof(buffer),
+                    "%s{\"name\":\"%s\",\"cat\":\"jpeg\",\"ph\":\"X\",\"pid\":1,\"tid\":%zu,"
+                    "\"ts\":%.3f,\"dur\":%.3f",
+                    separator, event.name, events->thread_id, event.start / 1e3,
+                    (std::max(event.end, event.start) - event.start) / 1e3);
+                output.write(buffer, std::min<size_t>(length, sizeof(buffer) - 1));
+                if (event.arg_name) {
+                    output << ",\"args\":{\"" << event.arg_name << "\":" << event.arg << '}';
+                }
+                output << '}';
+                separator = ",\n";
+            }
+        }
+    }
+    output << "\n],\"displayTimeUnit\":\"ns\"}\n";
+}
+
+#ifdef JPEG_DECODER_TRACE
+uint64_t TraceNow() {
+    if (!tracing.load(std::memory_order_relaxed)) {
+        return 0;
+    }
+    int64_t elapsed = ClockNanoseconds() - trace_origin.load(std::memory_order_relaxed);
+    return std::max<int64_t>(elapsed, 1);
+}
+
+void RecordTraceEvent(const char* name, uint64_t start, const char* arg_name, int64_t arg) {
+    if (!start) {
+        return;
+    }
+    thread_local ThreadSlot slot;
+    ThreadEvents& events = slot.Get();
+    uint64_t current = trace_generation.load(std::memory_order_acquire);
+    if (events.generation.load(std::memory_order_relaxed) != current) {
+        events.Reset(current);
+    }
+    int64_t end = ClockNanoseconds() - trace_origin.load(std::memory_order_relaxed);
+    events.Append({name, arg_name, arg, start, static_cast<uint64_t>(std::max<int64_t>(end, 1))});
+}
+#endif
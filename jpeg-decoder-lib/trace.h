@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstdint>
+#include <ostream>
+
+/*
+        Timeline of decode internals in Chrome trace event format, for chrome://tracing
+        and ui.perfetto.dev. Events are recorded only when the library is built with
+        JPEG_DECODER_TRACE and between StartTrace and StopTrace. Every thread appends
+        to buffers of its own without locks, a lock is taken once per thread.
+
+            StartTrace();
+            ... decodes on any threads ...
+            StopTrace();
+            WriteTrace(file);
+*/
+
+// Starts recording events of all threads, dropping those of the previous trace.
+void StartTrace();
+
+// Stops recording, scopes open on other threads are still recorded when they close.
+void StopTrace();
+
+// Writes events of the last trace as JSON. Traced decodes must be finished and no trace
+// may start meanwhile. The trace is empty unless the library is built with JPEG_DECODER_TRACE.
+void WriteTrace(std::ostream& output);
+
+#ifdef JPEG_DECODER_TRACE
+// Nanoseconds since StartTrace, never 0 while tracing, 0 otherwise.
+uint64_t TraceNow();
+
+// Records event |name| from |start| of TraceNow until now, unless |start| is 0. Names are
+// string literals, |arg_name| as well if the event has an integer argument.
+void RecordTraceEvent(const char* name, uint64_t start, const char* arg_name = nullptr,
+                      int64_t arg = 0);
+#else
+inline uint64_t TraceNow() {
+    return 0;
+}
+
+inline void RecordTraceEvent(const char*, uint64_t, const char* = nullptr, int64_t = 0) {
+}
+#endif
+
+// Records its scope as an event.
+class TraceScope {
+public:
+#ifdef JPEG_DECODER_TRACE
+    explicit TraceScope(const char* name, const char* arg_name = nullptr, int64_t arg = 0)
+        : name_(name), arg_name_(arg_name), arg_(arg), start_(TraceNow()) {
+    }
+    ~TraceScope() {
+        RecordTraceEvent(name_, start_, arg_name_, arg_);
+    }
+
+private:
+    const char* name_;
+    const char* arg_name_;
+    int64_t arg_;
+    uint64_t start_;
+#else
+    explicit TraceScope(const char*, const char* = nullptr, int64_t = 0) {
+    }
+#endif
+};
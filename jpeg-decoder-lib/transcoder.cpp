@@ -0,0 +1,574 @@
+#include "transcoder.h"
+
+#include <glog/logging.h>
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <optional>
+#include <stdexcept>
+
+#include "context.h"
+#include "standard_tables.h"
+
+namespace {
+
+constexpr size_t kSymbols = 256;
+constexpr size_t kMaxCodeLength = 16;
+constexpr uint8_t kEndOfBlock = 0x00;
+constexpr uint8_t kZeroRun = 0xF0;  // 16 zeros
+constexpr size_t kMaxMagnitudeBits = 11;
+// SOI, APPn, DQT, SOF, DHT and SOS sections of the output
+constexpr size_t kMaxHeaderBytes = 2048;
+// a code and magnitude at their longest for every coefficient and end of block, each byte
+// stuffed, with room for the last byte and EOI
+constexpr size_t kMaxBlockBytes =
+    (kDataUnitSize + 1) * (kMaxCodeLength + kMaxMagnitudeBits) / kBitsInByte * 2 + 4;
+
+using Table = std::array<uint16_t, kDataUnitSize>;  // natural order
+
+// IJG scaling of Annex K table, quality 50 gives the table itself.
+Table ScaleTable(const Table& base, int quality) {
+    int scale = quality < 50 ? 5000 / quality : 200 - quality * 2;
+    Table result;
+    for (size_t i = 0; i < kDataUnitSize; ++i) {
+        result[i] = std::clamp((base[i] * scale + 50) / 100, 1, 255);
+    }
+    return result;
+}
+
+// Number of bits in magnitude of |value|, the JPEG size category.
+uint8_t Category(int value) {
+    uint8_t bits = 0;
+    for (int magnitude = std::abs(value); magnitude; magnitude >>= 1) {
+        ++bits;
+    }
+    return bits;
+}
+
+struct HuffmanCode {
+    std::array<uint8_t, kMaxCodeLength> bits{};  // codes of each length, DHT layout
+    std::vector<uint8_t> values;
+    std::array<uint16_t, kSymbols> codes{};
+    std::array<uint8_t, kSymbols> lengths{};
+};
+
+// Optimal code limited to 16 bits for symbol frequencies, ITU T.81 Annex K.2.
+// A reserved symbol keeps any code from being all ones.
+HuffmanCode BuildCode(const std::array<size_t, kSymbols>& frequencies) {
+    constexpr size_t kMaxLength = 32;
+
+    std::array<size_t, kSymbols + 1> freq;
+    std::copy(frequencies.begin(), frequencies.end(), freq.begin());
+    freq[kSymbols] = 1;
+    std::array<size_t, kSymbols + 1> code_size{};
+    std::array<int, kSymbols + 1> others;
+    others.fill(-1);
+
+    while (true) {
+        // two least frequent nodes, ties are broken towards larger symbols
+        int c1 = -1, c2 = -1;
+        for (size_t i = 0; i <= kSymbols; ++i) {
+            if (freq[i] && (c1 < 0 || freq[i] <= freq[c1])) {
+                c1 = i;
+            }
+        }
+        for (size_t i = 0; i <= kSymbols; ++i) {
+            if (freq[i] && static_cast<int>(i) != c1 && (c2 < 0 || freq[i] <= freq[c2])) {
+                c2 = i;
+            }
+        }
+        if (c2 < 0) {
+            break;
+        }
+
+        freq[c1] += freq[c2];
+        freq[c2] = 0;
+
+        ++code_size[c1];
+        while (others[c1] >= 0) {
+            c1 = others[c1];
+            ++code_size[c1];
+        }
+        others[c1] = c2;
+
+        ++code_size[c2];
+        while (others[c2] >= 0) {
+            c2 = others[c2];
+            ++code_size[c2];
+        }
+    }
+
+    std::array<size_t, kMaxLength + 1> bits{};
+    for (size_t i = 0; i <= kSymbols; ++i) {
+        if (code_size[i]) {
+            if (code_size[i] > kMaxLength) {
+                throw std::logic_error("Huffman code is too long");
+            }
+            ++bits[code_size[i]];
+        }
+    }
+
+    // codes longer than 16 bits move to shorter lengths, prefix property is kept
+    for (size_t i = kMaxLength; i > kMaxCodeLength; --i) {
+        while (bits[i]) {
+            size_t j = i - 2;
+            while (!bits[j]) {
+                --j;
+            }
+            bits[i] -= 2;
+            ++bits[i - 1];
+            bits[j + 1] += 2;
+            --bits[j];
+        }
+    }
+
+    // drop the reserved symbol, it has the longest code
+    size_t longest = kMaxCodeLength;
+    while (!bits[longest]) {
+        --longest;
+    }
+    --bits[longest];
+
+    HuffmanCode code;
+    for (size_t length = 1; length <= kMaxCodeLength; ++length) {
+        code.bits[length - 1] = bits[length];
+    }
+    for (size_t length = 1; length <= kMaxLength; ++length) {
+        for (size_t symbol = 0; symbol < kSymbols; ++symbol) {
+            if (code_size[symbol] == length) {
+                code.values.push_back(symbol);
+            }
+        }
+    }
+
+    // canonical codes, Annex C
+    uint16_t next = 0;
+    size_t k = 0;
+    for (size_t length = 1; length <= kMaxCodeLength; ++length) {
+        for (size_t i = 0; i < code.bits[length - 1]; ++i, ++k) {
+            code.codes[code.values[k]] = next++;
+            code.lengths[code.values[k]] = length;
+        }
+        next <<= 1;
+    }
+    return code;
+}
+
+class BitWriter {
+public:
+    explicit BitWriter(std::vector<uint8_t>& output) : output_(output) {
+    }
+
+    void Write(uint32_t bits, size_t count) {
+        for (size_t i = count; i-- > 0;) {
+            byte_ = (byte_ << 1) | ((bits >> i) & 1);
+            if (++filled_ == kBitsInByte) {
+                Emit();
+            }
+        }
+    }
+
+    // Pads the last byte with ones, as decoders expect before a marker.
+    void Flush() {
+        while (filled_) {
+            Write(1, 1);
+        }
+    }
+
+private:
+    void Emit() {
+        output_.push_back(byte_);
+        if (byte_ == 0xFF) {
+            output_.push_back(0);  // stuffing, 0xFF would start a marker
+        }
+        byte_ = 0;
+        filled_ = 0;
+    }
+
+private:
+    std::vector<uint8_t>& output_;
+    uint8_t byte_ = 0;
+    size_t filled_ = 0;
+};
+
+void WriteDoubleByte(std::vector<uint8_t>& output, uint16_t value) {
+    output.push_back(value >> kBitsInByte);
+    output.push_back(value & 0xFF);
+}
+
+void WriteSection(std::vector<uint8_t>& output, uint16_t marker,
+                  const std::vector<uint8_t>& payload) {
+    WriteDoubleByte(output, marker);
+    WriteDoubleByte(output, payload.size() + 2);
+    output.insert(output.end(), payload.begin(), payload.end());
+}
+
+class Transcoder {
+public:
+    Transcoder(const CoefficientStore& store, const TranscodeOptions& options);
+
+    std::vector<uint8_t> Run();
+
+private:
+    // Passes channel and requantized, transformed zigzag coefficients of every block
+    // of the output to |visit| in scan order.
+    template <class Visitor>
+    void ForEachBlock(Visitor&& visit) const;
+
+    // Index of the source block shown at output block row, column of the channel,
+    // nullopt for output padding without source.
+    std::optional<size_t> SourceBlock(size_t c, size_t row, size_t column) const;
+
+    void WriteHeaders(std::vector<uint8_t>& output) const;
+
+    // Grows capacity of |output| to at least |size| bytes, throws LimitExceededError
+    // if it would not fit max_memory along with the store.
+    void Reserve(std::vector<uint8_t>& output, size_t size) const;
+
+private:
+    const CoefficientStore& store_;
+    size_t max_memory_;
+    size_t tables_;                 // luma and chroma or luma only
+    std::vector<size_t> table_of_;  // per channel
+    std::vector<Table> quant_;      // new tables, in source orientation
+    std::vector<HuffmanCode> dc_codes_;
+    std::vector<HuffmanCode> ac_codes_;
+    size_t max_h_ = 1;  // of source
+    size_t max_v_ = 1;
+
+    // source data units per MCU of each channel, along x and y
+    std::vector<size_t> units_w_;
+    std::vector<size_t> units_h_;
+    size_t mcu_columns_ = 0;  // of source
+
+    bool transpose_ = false;
+    bool mirror_x_ = false;  // output reads source columns right to left
+    bool mirror_y_ = false;
+    size_t width_ = 0;  // of output, source is trimmed to whole MCUs along mirrored axes
+    size_t height_ = 0;
+};
+
+Transcoder::Transcoder(const CoefficientStore& store, const TranscodeOptions& options)
+    : store_(store), max_memory_(options.limits.max_memory) {
+    if (options.quality < 1 || options.quality > 100) {
+        throw std::invalid_argument("Quality must be in 1..100");
+    }
+    if (store.Precision() != 8) {
+        throw std::invalid_argument("Only 8-bit pictures are transcoded to baseline");
+    }
+
+    ColorSpace color_space = store.GetColorSpace();
+    bool has_chroma = color_space == ColorSpace::YCbCr || color_space == ColorSpace::YCCK;
+    tables_ = has_chroma ? 2 : 1;
+
+    for (size_t c = 0; c < store.Channels(); ++c) {
+        const auto& channel = store.GetChannel(c);
+        max_h_ = std::max<size_t>(max_h_, channel.horizontal_thinning);
+        max_v_ = std::max<size_t>(max_v_, channel.vertical_thinning);
+        table_of_.push_back(has_chroma && (c == static_cast<size_t>(ChannelNames::Cb) ||
+                                           c == static_cast<size_t>(ChannelNames::Cr)));
+    }
+
+    quant_ = {ScaleTable(annex_k::kLuminanceQuant, options.quality),
+              ScaleTable(annex_k::kChrominanceQuant, options.quality)};
+    quant_.resize(tables_);
+
+    for (size_t c = 0; c < store.Channels(); ++c) {
+        const auto& channel = store.GetChannel(c);
+        units_w_.push_back(max_h_ / channel.horizontal_thinning);
+        units_h_.push_back(max_v_ / channel.vertical_thinning);
+
+        Table& table = quant_[table_of_[c]];
+        for (size_t i = 0; i < kDataUnitSize; ++i) {
+            table[i] = std::max(table[i], channel.quant_table[i]);
+        }
+    }
+
+    switch (options.transform) {
+        case Transform::None:
+            break;
+        case Transform::FlipHorizontal:
+            mirror_x_ = true;
+            break;
+        case Transform::FlipVertical:
+            mirror_y_ = true;
+            break;
+        case Transform::Transpose:
+            transpose_ = true;
+            break;
+        case Transform::Transverse:
+            transpose_ = mirror_x_ = mirror_y_ = true;
+            break;
+        case Transform::Rotate90:
+            transpose_ = mirror_y_ = true;
+            break;
+        case Transform::Rotate180:
+            mirror_x_ = mirror_y_ = true;
+            break;
+        case Transform::Rotate270:
+            transpose_ = mirror_x_ = true;
+            break;
+    }
+
+    // partial MCUs at the right or bottom can not move to the opposite edge losslessly
+    size_t mcu_width = max_h_ * kDataUnitSide, mcu_height = max_v_ * kDataUnitSide;
+    mcu_columns_ = (store.Width() + mcu_width - 1) / mcu_width;
+    size_t width = mirror_x_ ? store.Width() / mcu_width * mcu_width : store.Width();
+    size_t height = mirror_y_ ? store.Height() / mcu_height * mcu_height : store.Height();
+    if (!width || !height) {
+        throw std::invalid_argument("Picture is smaller than MCU, can not transform it");
+    }
+    width_ = transpose_ ? height : width;
+    height_ = transpose_ ? width : height;
+}
+
+std::optional<size_t> Transcoder::SourceBlock(size_t c, size_t row, size_t column) const {
+    size_t mcu_width = max_h_ * kDataUnitSide, mcu_height = max_v_ * kDataUnitSide;
+    size_t mcu_rows = (store_.Height() + mcu_height - 1) / mcu_height;
+
+    // trimmed source size in blocks of the channel
+    size_t columns = (mirror_x_ ? store_.Width() / mcu_width : mcu_columns_) * units_w_[c];
+    size_t rows = (mirror_y_ ? store_.Height() / mcu_height : mcu_rows) * units_h_[c];
+
+    if (transpose_) {
+        std::swap(row, column);
+    }
+    if (row >= rows || column >= columns) {
+        return std::nullopt;
+    }
+    if (mirror_x_) {
+        column = columns - 1 - column;
+    }
+    if (mirror_y_) {
+        row = rows - 1 - row;
+    }
+
+    size_t mcu = (row / units_h_[c]) * mcu_columns_ + column / units_w_[c];
+    size_t unit = (row % units_h_[c]) * units_w_[c] + column % units_w_[c];
+    return mcu * units_w_[c] * units_h_[c] + unit;
+}
+
+template <class Visitor>
+void Transcoder::ForEachBlock(Visitor&& visit) const {
+    // output MCU layout, transposed along with the picture
+    size_t max_h = transpose_ ? max_v_ : max_h_, max_v = transpose_ ? max_h_ : max_v_;
+    size_t mcu_width = max_h * kDataUnitSide, mcu_height = max_v * kDataUnitSide;
+    size_t mcu_columns = (width_ + mcu_width - 1) / mcu_width;
+    size_t mcus = mcu_columns * ((height_ + mcu_height - 1) / mcu_height);
+
+    // mirroring the picture along an axis negates odd frequencies along it
+    bool negate_rows = transpose_ ? mirror_x_ : mirror_y_;
+    bool negate_columns = transpose_ ? mirror_y_ : mirror_x_;
+
+    std::array<int, kDataUnitSize> source;  // natural order
+    std::array<int, kDataUnitSize> block;   // zigzag order
+
+    for (size_t mcu = 0; mcu < mcus; ++mcu) {
+        for (size_t c = 0; c < store_.Channels(); ++c) {
+            const Table& from = store_.GetChannel(c).quant_table;
+            const Table& to = quant_[table_of_[c]];
+            size_t units_w = transpose_ ? units_h_[c] : units_w_[c];
+            size_t units_h = transpose_ ? units_w_[c] : units_h_[c];
+
+            for (size_t unit = 0; unit < units_w * units_h; ++unit) {
+                size_t row = (mcu / mcu_columns) * units_h + unit / units_w;
+                size_t column = (mcu % mcu_columns) * units_w + unit % units_w;
+
+                source.fill(0);
+                if (auto index = SourceBlock(c, row, column)) {
+                    auto coefs = store_.Block(c, *index);
+                    for (size_t i = 0; i < coefs.size(); ++i) {
+                        size_t pos = kZigzagOrder[i];
+                        source[pos] =
+                            std::lround(static_cast<double>(coefs[i]) * from[pos] / to[pos]);
+                    }
+                }
+
+                for (size_t i = 0; i < kDataUnitSize; ++i) {
+                    size_t u = kZigzagOrder[i] / kDataUnitSide, v = kZigzagOrder[i] % kDataUnitSide;
+                    int value = source[transpose_ ? v * kDataUnitSide + u : kZigzagOrder[i]];
+                    bool negate = (negate_rows && u % 2) != (negate_columns && v % 2);
+                    block[i] = negate ? -value : value;
+                }
+                visit(c, block);
+            }
+        }
+    }
+}
+
+// Calls |emit| with Huffman symbol and magnitude bits of each coded element, DC first.
+template <class Emit>
+void EncodeBlock(const std::array<int, kDataUnitSize>& block, int& prev_dc, Emit&& emit) {
+    int diff = block[0] - prev_dc;
+    prev_dc = block[0];
+    uint8_t size = Category(diff);
+    emit(true, size, diff, size);
+
+    size_t run = 0;
+    for (size_t i = 1; i < kDataUnitSize; ++i) {
+        if (!block[i]) {
+            ++run;
+            continue;
+        }
+        for (; run >= 16; run -= 16) {
+            emit(false, kZeroRun, 0, 0);
+        }
+        size = Category(block[i]);
+        emit(false, static_cast<uint8_t>(run << 4 | size), block[i], size);
+        run = 0;
+    }
+    if (run) {
+        emit(false, kEndOfBlock, 0, 0);
+    }
+}
+
+std::vector<uint8_t> Transcoder::Run() {
+    std::vector<std::array<size_t, kSymbols>> dc_freq(tables_), ac_freq(tables_);
+    std::vector<int> prev_dc(store_.Channels(), 0);
+    size_t bits = 0;  // of magnitudes, codes are added once they are built
+
+    ForEachBlock([&](size_t c, const std::array<int, kDataUnitSize>& block) {
+        size_t t = table_of_[c];
+        EncodeBlock(block, prev_dc[c], [&](bool dc, uint8_t symbol, int, uint8_t size) {
+            ++(dc ? dc_freq : ac_freq)[t][symbol];
+            bits += size;
+        });
+    });
+
+    for (size_t t = 0; t < tables_; ++t) {
+        dc_codes_.push_back(BuildCode(dc_freq[t]));
+        ac_codes_.push_back(BuildCode(ac_freq[t]));
+        for (size_t symbol = 0; symbol < kSymbols; ++symbol) {
+            bits += dc_freq[t][symbol] * dc_codes_[t].lengths[symbol];
+            bits += ac_freq[t][symbol] * ac_codes_[t].lengths[symbol];
+        }
+    }
+
+    // stuffing is not known ahead, it grows the output further as it comes
+    std::vector<uint8_t> output;
+    Reserve(output, kMaxHeaderBytes + bits / kBitsInByte);
+    WriteHeaders(output);
+
+    BitWriter writer(output);
+    std::fill(prev_dc.begin(), prev_dc.end(), 0);
+    ForEachBlock([&](size_t c, const std::array<int, kDataUnitSize>& block) {
+        size_t t = table_of_[c];
+        Reserve(output, output.size() + kMaxBlockBytes);
+        EncodeBlock(block, prev_dc[c], [&](bool dc, uint8_t symbol, int value, uint8_t size) {
+            const HuffmanCode& code = dc ? dc_codes_[t] : ac_codes_[t];
+            writer.Write(code.codes[symbol], code.lengths[symbol]);
+            if (size) {
+                // negative values are written as value - 1 in |size| bits
+                writer.Write(value < 0 ? value + (1 << size) - 1 : value, size);
+            }
+        });
+    });
+    writer.Flush();
+
+    WriteDoubleByte(output, 0xFFD9);  // EOI
+    return output;
+}
+
+void Transcoder::Reserve(std::vector<uint8_t>& output, size_t size) const {
+    if (size <= output.capacity()) {
+        return;
+    }
+    size_t capacity = std::max(size, output.capacity() * 2);
+    if (max_memory_ && store_.Size() + capacity > max_memory_) {
+        throw LimitExceededError("Transcoding needs " + std::to_string(store_.Size() + capacity) +
+                                 " bytes, limit is " + std::to_string(max_memory_));
+    }
+    output.reserve(capacity);
+}
+
+void Transcoder::WriteHeaders(std::vector<uint8_t>& output) const {
+    WriteDoubleByte(output, 0xFFD8);  // SOI
+
+    ColorSpace color_space = store_.GetColorSpace();
+    if (color_space == ColorSpace::Grayscale || color_space == ColorSpace::YCbCr) {
+        // JFIF 1.01, no density and thumbnail
+        WriteSection(output, 0xFFE0, {'J', 'F', 'I', 'F', 0, 1, 1, 0, 0, 1, 0, 1, 0, 0});
+    } else {
+        // Adobe: version 100, no flags, transform 2 for YCCK and 0 otherwise
+        uint8_t transform = color_space == ColorSpace::YCCK ? 2 : 0;
+        WriteSection(output, 0xFFEE, {'A', 'd', 'o', 'b', 'e', 0, 100, 0, 0, 0, 0, transform});
+    }
+
+    bool extended = false;  // baseline allows 8-bit tables only
+    for (size_t t = 0; t < tables_; ++t) {
+        bool wide = *std::max_element(quant_[t].begin(), quant_[t].end()) > 255;
+        extended |= wide;
+        std::vector<uint8_t> payload = {static_cast<uint8_t>((wide << 4) | t)};
+        for (uint8_t pos : kZigzagOrder) {
+            size_t u = pos / kDataUnitSide, v = pos % kDataUnitSide;
+            uint16_t value = quant_[t][transpose_ ? v * kDataUnitSide + u : pos];
+            if (wide) {
+                payload.push_back(value >> kBitsInByte);
+            }
+            payload.push_back(value & 0xFF);
+        }
+        WriteSection(output, 0xFFDB, payload);
+    }
+
+    std::vector<uint8_t> frame = {8};  // precision
+    for (uint16_t value : {height_, width_}) {
+        frame.push_back(value >> kBitsInByte);
+        frame.push_back(value & 0xFF);
+    }
+    frame.push_back(store_.Channels());
+    for (size_t c = 0; c < store_.Channels(); ++c) {
+        const auto& channel = store_.GetChannel(c);
+        size_t h = transpose_ ? units_h_[c] : units_w_[c];
+        size_t v = transpose_ ? units_w_[c] : units_h_[c];
+        frame.push_back(channel.id);
+        frame.push_back(h << 4 | v);
+        frame.push_back(table_of_[c]);
+    }
+    WriteSection(output, extended ? 0xFFC1 : 0xFFC0, frame);
+
+    for (size_t t = 0; t < tables_; ++t) {
+        for (bool ac : {false, true}) {
+            const HuffmanCode& code = ac ? ac_codes_[t] : dc_codes_[t];
+            std::vector<uint8_t> payload = {static_cast<uint8_t>((ac << 4) | t)};
+            payload.insert(payload.end(), code.bits.begin(), code.bits.end());
+            payload.insert(payload.end(), code.values.begin(), code.values.end());
+            WriteSection(output, 0xFFC4, payload);
+        }
+    }
+
+    std::vector<uint8_t> scan = {static_cast<uint8_t>(store_.Channels())};
+    for (size_t c = 0; c < store_.Channels(); ++c) {
+        scan.push_back(store_.GetChannel(c).id);
+        scan.push_back(table_of_[c] << 4 | table_of_[c]);
+    }
+    scan.insert(scan.end(), {0, 63, 0});  // spectral selection of sequential DCT
+    WriteSection(output, 0xFFDA, scan);
+}
+
+}  // namespace
+
+std::vector<uint8_t> Transcode(std::istream& input, const TranscodeOptions& options) {
+    DecodeOptions decode_options;
+    decode_options.limits = options.limits;
+    return Transcode(CoefficientStore::Read(input, decode_options), options);
+}
+
+Transform TransformForOrientation(int orientation) {
+    // indexed by orientation - 1
+    constexpr std::array<Transform, 8> kTransforms = {
+        Transform::None,         Transform::FlipHorizontal, Transform::Rotate180,
+        Transform::FlipVertical, Transform::Transpose,      Transform::Rotate90,
+        Transform::Transverse,   Transform::Rotate270,
+    };
+
+    if (orientation < 1 || orientation > 8) {
+        return Transform::None;  // unknown values are ignored like a missing tag
+    }
+    return kTransforms[orientation - 1];
+}
+
+std::vector<uint8_t> Transcode(const CoefficientStore& store, const TranscodeOptions& options) {
+    DLOG(INFO) << "Transcoding " << store.Width() << 'x' << store.Height() << " with quality "
+               << options.quality << ", transform " << static_cast<int>(options.transform);
+    return Transcoder(store, options).Run();
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstdint>
+#include <istream>
+#include <vector>
+
+#include "coefficient_store.h"
+#include "options.h"
+
+// Lossless transforms of the picture, rotations are clockwise.
+enum class Transform {
+    None,
+    FlipHorizontal,
+    FlipVertical,
+    Transpose,   // across the main diagonal
+    Transverse,  // across the other diagonal
+    Rotate90,
+    Rotate180,
+    Rotate270,
+};
+
+struct TranscodeOptions {
+    // IJG quality (1..100) of Annex K tables the coefficients are requantized to.
+    // Steps finer than the source ones are never used, they would only grow the file,
+    // so quality 100 keeps coefficients as they are.
+    int quality = 75;
+    // Applied to coefficient blocks: blocks move to their new place, transposed and with
+    // odd frequencies negated along mirrored axes. Partial MCUs at the right or bottom
+    // edge can not be mirrored and are trimmed, like jpegtran -trim does.
+    Transform transform = Transform::None;
+    // Apply to reading the picture; max_memory also bounds the store and the output
+    // buffer together while transcoding.
+    DecodeLimits limits;
+};
+
+// Recompresses a baseline JPEG in the DCT domain: coefficients are requantized
+// against new tables and entropy coded with Huffman tables optimized for them.
+// There is no IDCT, color conversion or forward DCT, so no pixel round trip loss.
+// Returns the new baseline JPEG file, or extended sequential (SOF1) if a source table
+// has steps over 255, which need 16-bit tables.
+std::vector<uint8_t> Transcode(std::istream& input, const TranscodeOptions& options = {});
+
+std::vector<uint8_t> Transcode(const CoefficientStore& store, const TranscodeOptions& options = {});
+
+// Transform displaying the picture upright for EXIF orientation 1..8, None for other values.
+Transform TransformForOrientation(int orientation);
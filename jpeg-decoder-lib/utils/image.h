@@ -1,46 +1,231 @@
 #pragma once
 
 #include <vector>
+#include <algorithm>
 #include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
 #include <string>
 
 struct RGB {
     int r, g, b;
 };
 
+enum class PixelFormat {
+    RGB,     // one RGB struct per pixel
+    Gray8,   // single 8-bit plane, no chroma
+    RGB8,    // interleaved 8-bit r, g, b samples, three bytes per pixel
+    Gray16,  // single plane of 16-bit samples in native byte order
+    RGB16,   // interleaved 16-bit r, g, b samples in native byte order
+};
+
 class Image {
 public:
     Image() {
     }
-    Image(size_t width, size_t height) {
-        SetSize(width, height);
+    Image(size_t width, size_t height, PixelFormat format = PixelFormat::RGB) {
+        SetSize(width, height, format);
     }
 
-    void SetSize(size_t width, size_t height) {
-        data_.assign(height, std::vector<RGB>(width));
+    // Memory kept alive by an owner, like a pooled buffer, is copied rather than shared,
+    // so copies are independent values and do not hold the buffer back from its pool.
+    Image(const Image& other)
+        : width_(other.width_),
+          height_(other.height_),
+          format_(other.format_),
+          bytes_(other.bytes_),
+          external_(other.external_),
+          stride_(other.stride_),
+          comment_(other.comment_) {
+        if (other.owner_) {
+            external_ = nullptr;
+            stride_ = width_ * PixelBytes(format_);
+            bytes_.resize(stride_ * height_);
+            for (size_t y = 0; y < height_; ++y) {
+                std::copy(other.Bytes(y), other.Bytes(y) + stride_, Bytes(y));
+            }
+        }
     }
 
-    size_t Width() const {
-        if (data_.empty()) {
-            return 0;
+    Image& operator=(const Image& other) {
+        if (this != &other) {
+            *this = Image(other);
         }
-        return data_[0].size();
+        return *this;
+    }
+
+    Image(Image&&) = default;
+    Image& operator=(Image&&) = default;
+
+    void SetSize(size_t width, size_t height, PixelFormat format = PixelFormat::RGB) {
+        width_ = width;
+        height_ = height;
+        format_ = format;
+        external_ = nullptr;
+        owner_.reset();
+        stride_ = width * PixelBytes(format);
+        bytes_.assign(stride_ * height, 0);
+    }
+
+    // Uses caller memory of |height| rows |stride| bytes apart instead of own storage.
+    // Rows are cleared like own storage. Without |owner| the memory must outlive the image
+    // and its copies, which share it; with one the image keeps it alive and copies get
+    // pixels of their own.
+    void Wrap(uint8_t* pixels, size_t stride, size_t width, size_t height, PixelFormat format,
+              std::shared_ptr<void> owner = nullptr) {
+        if (stride < width * PixelBytes(format)) {
+            throw std::invalid_argument("Stride is less than a row");
+        }
+        if (reinterpret_cast<uintptr_t>(pixels) % Alignment(format) || stride % Alignment(format)) {
+            throw std::invalid_argument("Rows are not aligned for their samples");
+        }
+        width_ = width;
+        height_ = height;
+        format_ = format;
+        bytes_.clear();
+        external_ = pixels;
+        owner_ = std::move(owner);
+        stride_ = stride;
+        for (size_t y = 0; y < height; ++y) {
+            std::fill(Bytes(y), Bytes(y) + width * PixelBytes(format), 0);
+        }
+    }
+
+    // Whether |height| rows of |width| pixels |stride| bytes apart fit in |size| bytes.
+    // Checked without overflow, strides come from callers over FFI.
+    static bool FitsBuffer(size_t width, size_t height, PixelFormat format, size_t stride,
+                           size_t size) {
+        size_t row_bytes = width * PixelBytes(format);
+        if (stride < row_bytes || row_bytes > size) {
+            return false;
+        }
+        return height <= 1 || stride <= (size - row_bytes) / (height - 1);
+    }
+
+    static size_t PixelBytes(PixelFormat format) {
+        switch (format) {
+            case PixelFormat::Gray8:
+                return 1;
+            case PixelFormat::Gray16:
+                return 2;
+            case PixelFormat::RGB8:
+                return 3;
+            case PixelFormat::RGB16:
+                return 6;
+            default:
+                return sizeof(RGB);
+        }
+    }
+
+    // Of row starts, bytes of one sample.
+    static size_t Alignment(PixelFormat format) {
+        switch (format) {
+            case PixelFormat::Gray8:
+            case PixelFormat::RGB8:
+                return 1;
+            case PixelFormat::Gray16:
+            case PixelFormat::RGB16:
+                return 2;
+            default:
+                return alignof(RGB);
+        }
+    }
+
+    static bool IsGray(PixelFormat format) {
+        return format == PixelFormat::Gray8 || format == PixelFormat::Gray16;
+    }
+
+    static bool Is16Bit(PixelFormat format) {
+        return format == PixelFormat::Gray16 || format == PixelFormat::RGB16;
+    }
+
+    size_t Width() const {
+        return width_;
     }
 
     size_t Height() const {
-        return data_.size();
+        return height_;
     }
 
+    PixelFormat Format() const {
+        return format_;
+    }
+
+    // Packed samples are truncated to their width.
     void SetPixel(int y, int x, const RGB& pixel) {
-        data_[y][x] = pixel;
+        if (format_ == PixelFormat::RGB8) {
+            uint8_t* sample = Bytes(y) + 3 * x;
+            sample[0] = pixel.r;
+            sample[1] = pixel.g;
+            sample[2] = pixel.b;
+            return;
+        }
+        if (format_ == PixelFormat::RGB16) {
+            uint16_t* sample = GetRow16(y) + 3 * x;
+            sample[0] = pixel.r;
+            sample[1] = pixel.g;
+            sample[2] = pixel.b;
+            return;
+        }
+        if (format_ != PixelFormat::RGB) {
+            throw std::logic_error("Gray images are written with SetGray");
+        }
+        GetRow(y)[x] = pixel;
     }
 
+    // Gray images are expanded to r == g == b.
     RGB GetPixel(int y, int x) const {
-        return data_[y][x];
+        switch (format_) {
+            case PixelFormat::Gray8:
+            case PixelFormat::Gray16: {
+                int value = GetGray(y, x);
+                return {value, value, value};
+            }
+            case PixelFormat::RGB8: {
+                const uint8_t* sample = Bytes(y) + 3 * x;
+                return {sample[0], sample[1], sample[2]};
+            }
+            case PixelFormat::RGB16: {
+                const uint16_t* sample = reinterpret_cast<const uint16_t*>(Bytes(y)) + 3 * x;
+                return {sample[0], sample[1], sample[2]};
+            }
+            default:
+                return GetRow(y)[x];
+        }
+    }
+
+    RGB* GetRow(size_t y) {
+        return reinterpret_cast<RGB*>(Bytes(y));
+    }
+
+    const RGB* GetRow(size_t y) const {
+        return reinterpret_cast<const RGB*>(Bytes(y));
+    }
+
+    // Gray8 and Gray16 images.
+    int GetGray(int y, int x) const {
+        if (format_ == PixelFormat::Gray16) {
+            return reinterpret_cast<const uint16_t*>(Bytes(y))[x];
+        }
+        return Bytes(y)[x];
+    }
+
+    void SetGray(int y, int x, int value) {
+        if (format_ == PixelFormat::Gray16) {
+            GetRow16(y)[x] = value;
+        } else {
+            Bytes(y)[x] = value;
+        }
+    }
+
+    uint8_t* GetGrayRow(size_t y) {
+        return Bytes(y);
     }
 
-    RGB& GetPixel(int y, int x) {
-        return data_[y][x];
+    // Samples of a Gray16 or RGB16 row.
+    uint16_t* GetRow16(size_t y) {
+        return reinterpret_cast<uint16_t*>(Bytes(y));
     }
 
     void SetComment(const std::string& comment) {
@@ -52,6 +237,17 @@ public:
     }
 
 private:
-    std::vector<std::vector<RGB>> data_;
+    uint8_t* Bytes(size_t y) const {
+        return const_cast<uint8_t*>(external_ ? external_ : bytes_.data()) + y * stride_;
+    }
+
+private:
+    size_t width_ = 0;
+    size_t height_ = 0;
+    PixelFormat format_ = PixelFormat::RGB;
+    std::vector<uint8_t> bytes_;  // rows, unless external_ is set
+    uint8_t* external_ = nullptr;
+    std::shared_ptr<void> owner_;  // of external_ memory, if anyone
+    size_t stride_ = 0;            // bytes between rows
     std::string comment_;
 };
@@ -0,0 +1,431 @@
+// Batch decoder: decodes files and directories on a pool of workers, writes or discards
+// the images and reports per-file and aggregate throughput. Run without arguments for usage.
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <iterator>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <glog/logging.h>
+
+#include "buffer_pool.h"
+#include "decoder.h"
+#include "thread_pool.h"
+#include "trace.h"
+
+namespace fs = std::filesystem;
+
+namespace {
+
+constexpr const char* kUsage =
+    "Usage: jpeg-decode [options] <file or directory>...\n"
+    "  -j, --threads N     worker threads, 0 for hardware concurrency (default 1)\n"
+    "  -o, --output DIR    write images to DIR, they are discarded otherwise\n"
+    "  -f, --format F      ppm (PPM or PGM, default) or raw (pixels only)\n"
+    "      --gray          decode to grayscale, 16-bit for 12-bit pictures\n"
+    "      --probe         print picture parameters without decoding\n"
+    "  -s, --scale N       scale denominator: 1, 2, 4 or 8\n"
+    "      --crop X,Y,W,H  decode only this rectangle of the scaled image\n"
+    "      --size WxH      resize to W x H, 0 for one of them keeps the aspect ratio\n"
+    "      --tolerant      keep the decodable part of damaged files\n"
+    "  -r, --repeat N      decode every file N times for steadier timing\n"
+    "      --pool          reuse output memory of finished decodes\n"
+    "      --trace FILE    write a Chrome trace of the decodes, needs JPEG_DECODER_TRACE\n"
+    "  -q, --quiet         print the summary only\n"
+    "  -v, --verbose       log decoder internals, only warnings are logged otherwise\n";
+
+struct Settings {
+    size_t threads = 1;
+    std::string output;
+    bool raw = false;
+    bool probe = false;
+    bool quiet = false;
+    bool verbose = false;
+    bool buffer_pool = false;
+    std::string trace;
+    size_t repeat = 1;
+    DecodeOptions options;
+};
+
+struct Job {
+    fs::path input;
+    fs::path output;  // relative to the output directory, without extension
+};
+
+struct Result {
+    bool ok = false;
+    size_t bytes = 0;
+    size_t pixels = 0;
+    std::vector<double> latencies;  // seconds, one per repeat
+};
+
+size_t ParseNumber(const std::string& text) {
+    size_t end = 0;
+    unsigned long long value = std::stoull(text, &end);
+    if (end != text.size()) {
+        throw std::invalid_argument("Not a number: " + text);
+    }
+    return value;
+}
+
+// Splits "1,2,3" or "1x2" into numbers.
+std::vector<size_t> ParseList(const std::string& text, char separator) {
+    std::vector<size_t> result;
+    std::istringstream stream(text);
+    std::string item;
+    while (std::getline(stream, item, separator)) {
+        result.push_back(ParseNumber(item));
+    }
+    return result;
+}
+
+Settings ParseArguments(int argc, char** argv, std::vector<std::string>* paths) {
+    Settings settings;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        auto value = [&]() -> std::string {
+            if (i + 1 >= argc) {
+                throw std::invalid_argument("Missing value of " + arg);
+            }
+            return argv[++i];
+        };
+
+        if (arg == "-j" || arg == "--threads") {
+            settings.threads = ParseNumber(value());
+        } else if (arg == "-o" || arg == "--output") {
+            settings.output = value();
+        } else if (arg == "-f" || arg == "--format") {
+            std::string format = value();
+            if (format != "ppm" && format != "raw") {
+                throw std::invalid_argument("Unknown format: " + format);
+            }
+            settings.raw = (format == "raw");
+        } else if (arg == "--gray") {
+            settings.options.output_format = PixelFormat::Gray8;
+        } else if (arg == "--probe") {
+            settings.probe = true;
+        } else if (arg == "-s" || arg == "--scale") {
+            settings.options.scale_denominator = ParseNumber(value());
+        } else if (arg == "--crop") {
+            std::vector<size_t> crop = ParseList(value(), ',');
+            if (crop.size() != 4) {
+                throw std::invalid_argument("Crop is X,Y,W,H");
+            }
+            settings.options.first_column = crop[0];
+            settings.options.first_row = crop[1];
+            settings.options.column_count = crop[2];
+            settings.options.row_count = crop[3];
+        } else if (arg == "--size") {
+            std::vector<size_t> size = ParseList(value(), 'x');
+            if (size.size() != 2 || (!size[0] && !size[1])) {
+                throw std::invalid_argument("Size is WxH");
+            }
+            settings.options.output_width = size[0];
+            settings.options.output_height = size[1];
+        } else if (arg == "--tolerant") {
+            settings.options.tolerant = true;
+        } else if (arg == "-r" || arg == "--repeat") {
+            settings.repeat = std::max<size_t>(1, ParseNumber(value()));
+        } else if (arg == "--pool") {
+            settings.buffer_pool = true;
+        } else if (arg == "--trace") {
+            settings.trace = value();
+        } else if (arg == "-q" || arg == "--quiet") {
+            settings.quiet = true;
+        } else if (arg == "-v" || arg == "--verbose") {
+            settings.verbose = true;
+        } else if (!arg.empty() && arg[0] == '-') {
+            throw std::invalid_argument("Unknown option: " + arg);
+        } else {
+            paths->push_back(arg);
+        }
+    }
+    return settings;
+}
+
+bool IsJpeg(const fs::path& path) {
+    std::string extension = path.extension().string();
+    std::transform(extension.begin(), extension.end(), extension.begin(),
+                   [](unsigned char c) { return std::tolower(c); });
+    return extension == ".jpg" || extension == ".jpeg" || extension == ".jpe" ||
+           extension == ".jfif";
+}
+
+// Files of directories are taken recursively, outputs keep their relative paths.
+std::vector<Job> CollectJobs(const std::vector<std::string>& paths) {
+    std::vector<Job> jobs;
+    for (const std::string& path : paths) {
+        if (!fs::is_directory(path)) {
+            jobs.push_back({path, fs::path(path).filename().replace_extension()});
+            continue;
+        }
+
+        std::vector<Job> found;
+        for (const auto& entry : fs::recursive_directory_iterator(path)) {
+            if (entry.is_regular_file() && IsJpeg(entry.path())) {
+                found.push_back(
+                    {entry.path(), fs::relative(entry.path(), path).replace_extension()});
+            }
+        }
+        std::sort(found.begin(), found.end(),
+                  [](const Job& lhs, const Job& rhs) { return lhs.input < rhs.input; });
+        jobs.insert(jobs.end(), found.begin(), found.end());
+    }
+    return jobs;
+}
+
+// Files of the same name in different directories would overwrite each other's output.
+void CheckOutputs(const std::vector<Job>& jobs) {
+    std::vector<const Job*> sorted;
+    for (const Job& job : jobs) {
+        sorted.push_back(&job);
+    }
+    std::sort(sorted.begin(), sorted.end(),
+              [](const Job* lhs, const Job* rhs) { return lhs->output < rhs->output; });
+    for (size_t i = 1; i < sorted.size(); ++i) {
+        if (sorted[i - 1]->output == sorted[i]->output) {
+            throw std::invalid_argument("Outputs of " + sorted[i - 1]->input.string() + " and " +
+                                        sorted[i]->input.string() + " collide");
+        }
+    }
+}
+
+std::string ReadFile(const fs::path& path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        throw std::runtime_error("Cannot open file");
+    }
+    return {std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()};
+}
+
+// Samples of pictures over 8 bits take two bytes, most significant first as PNM has them.
+void WriteImage(const Image& image, const fs::path& path, bool raw, unsigned precision) {
+    bool gray = Image::IsGray(image.Format());
+    int max_value = (1 << precision) - 1;
+    size_t sample_bytes = precision > 8 ? 2 : 1;
+    fs::create_directories(path.parent_path());
+    std::ofstream file(path, std::ios::binary);
+
+    if (!raw) {
+        file << (gray ? "P5" : "P6") << '\n'
+             << image.Width() << ' ' << image.Height() << '\n'
+             << max_value << '\n';
+    }
+
+    std::vector<char> row(image.Width() * (gray ? 1 : 3) * sample_bytes);
+    char* sample = nullptr;
+    auto put = [&](int value) {
+        if (sample_bytes == 2) {
+            *sample++ = value >> 8;
+        }
+        *sample++ = value;
+    };
+    for (size_t y = 0; y < image.Height(); ++y) {
+        sample = row.data();
+        for (size_t x = 0; x < image.Width(); ++x) {
+            if (gray) {
+                put(image.GetGray(y, x));
+            } else {
+                RGB pixel = image.GetPixel(y, x);
+                put(pixel.r);
+                put(pixel.g);
+                put(pixel.b);
+            }
+        }
+        file.write(row.data(), row.size());
+    }
+
+    if (!file) {
+        throw std::runtime_error("Cannot write " + path.string());
+    }
+}
+
+const char* ColorSpaceName(ColorSpace color_space) {
+    switch (color_space) {
+        case ColorSpace::Grayscale:
+            return "grayscale";
+        case ColorSpace::YCbCr:
+            return "YCbCr";
+        case ColorSpace::RGB:
+            return "RGB";
+        case ColorSpace::CMYK:
+            return "CMYK";
+        case ColorSpace::YCCK:
+            return "YCCK";
+    }
+    return "unknown";
+}
+
+// Decodes or probes one file, prints its line unless quiet.
+Result Process(const Job& job, const Settings& settings, std::mutex* print_mutex) {
+    Result result;
+    std::string line;
+    try {
+        std::string data = ReadFile(job.input);
+        result.bytes = data.size();
+
+        if (settings.probe) {
+            std::istringstream input(data);
+            PictureInfo info = Decoder(input, settings.options).Probe();
+            char buffer[256];
+            std::snprintf(buffer, sizeof(buffer),
+                          "%zux%zu %zu channels %s %u-bit orientation %u%s", info.width,
+                          info.height, info.channels, ColorSpaceName(info.color_space),
+                          info.precision, info.orientation,
+                          info.has_thumbnail ? " thumbnail" : "");
+            line = buffer;
+        } else {
+            std::istringstream header(data);
+            unsigned precision = Decoder(header, settings.options).Probe().precision;
+            DecodeOptions options = settings.options;
+            if (options.output_format == PixelFormat::Gray8 && precision > 8) {
+                options.output_format = PixelFormat::Gray16;
+            }
+
+            Image image;
+            DecodeStatus status;
+            for (size_t i = 0; i < settings.repeat; ++i) {
+                std::istringstream input(data);
+                Decoder decoder(input, options);
+                auto start = std::chrono::steady_clock::now();
+                image = decoder.Decode();
+                std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+                result.latencies.push_back(elapsed.count());
+                status = decoder.GetStatus();
+            }
+            result.pixels = image.Width() * image.Height();
+
+            if (!settings.output.empty()) {
+                const char* extension =
+                    settings.raw ? ".raw"
+                                 : (Image::IsGray(image.Format()) ? ".pgm" : ".ppm");
+                fs::path path = fs::path(settings.output) / job.output;
+                WriteImage(image, path += extension, settings.raw, precision);
+            }
+
+            std::sort(result.latencies.begin(), result.latencies.end());
+            double latency = result.latencies[result.latencies.size() / 2];
+            char buffer[256];
+            std::snprintf(buffer, sizeof(buffer), "%zux%zu %.2f ms %.1f MB/s %.1f MP/s%s",
+                          image.Width(), image.Height(), latency * 1e3,
+                          result.bytes / latency / 1e6, result.pixels / latency / 1e6,
+                          status.complete ? "" : (" damaged: " + status.error).c_str());
+            line = buffer;
+        }
+        result.ok = true;
+    } catch (const std::exception& e) {
+        line = std::string("failed: ") + e.what();
+    }
+
+    if (!settings.quiet || !result.ok) {
+        std::lock_guard lock(*print_mutex);
+        std::printf("%s: %s\n", job.input.c_str(), line.c_str());
+    }
+    return result;
+}
+
+double Percentile(const std::vector<double>& sorted, double fraction) {
+    size_t index = std::min(sorted.size() - 1, static_cast<size_t>(fraction * sorted.size()));
+    return sorted[index];
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    std::vector<std::string> paths;
+    Settings settings;
+    try {
+        settings = ParseArguments(argc, argv, &paths);
+    } catch (const std::exception& e) {
+        std::fprintf(stderr, "%s\n%s", e.what(), kUsage);
+        return 2;
+    }
+    if (paths.empty()) {
+        std::fprintf(stderr, "%s", kUsage);
+        return 2;
+    }
+
+    FLAGS_logtostderr = true;
+    FLAGS_minloglevel = settings.verbose ? google::GLOG_INFO : google::GLOG_WARNING;
+    google::InitGoogleLogging(argv[0]);
+
+    std::vector<Job> jobs = CollectJobs(paths);
+    if (!settings.output.empty()) {
+        try {
+            CheckOutputs(jobs);
+        } catch (const std::exception& e) {
+            std::fprintf(stderr, "%s\n", e.what());
+            return 2;
+        }
+    }
+    BufferPool buffer_pool;
+    if (settings.buffer_pool) {
+        settings.options.buffer_pool = &buffer_pool;
+    }
+    std::mutex print_mutex;
+    std::vector<Result> results;
+
+    if (!settings.trace.empty()) {
+        StartTrace();
+    }
+    auto start = std::chrono::steady_clock::now();
+    {
+        ThreadPool pool(settings.threads);
+        std::vector<std::future<Result>> futures;
+        for (const Job& job : jobs) {
+            futures.push_back(
+                pool.Submit([&job, &settings, &print_mutex] {
+                    return Process(job, settings, &print_mutex);
+                }));
+        }
+        for (auto& future : futures) {
+            results.push_back(future.get());
+        }
+    }
+    std::chrono::duration<double> wall = std::chrono::steady_clock::now() - start;
+
+    if (!settings.trace.empty()) {
+        StopTrace();
+        std::ofstream trace(settings.trace);
+        WriteTrace(trace);
+        if (!trace) {
+            std::fprintf(stderr, "Cannot write %s\n", settings.trace.c_str());
+            return 1;
+        }
+    }
+
+    size_t failed = 0, bytes = 0, pixels = 0;
+    std::vector<double> latencies;
+    for (const Result& result : results) {
+        if (!result.ok) {
+            ++failed;
+            continue;
+        }
+        bytes += result.bytes * settings.repeat;
+        pixels += result.pixels * settings.repeat;
+        latencies.insert(latencies.end(), result.latencies.begin(), result.latencies.end());
+    }
+
+    std::printf("%zu files, %zu failed, %.3f s wall", jobs.size(), failed, wall.count());
+    if (!settings.probe && !latencies.empty()) {
+        std::sort(latencies.begin(), latencies.end());
+        std::printf(", %.1f MB/s, %.1f MP/s\nlatency ms: p50 %.2f p90 %.2f p99 %.2f max %.2f",
+                    bytes / wall.count() / 1e6, pixels / wall.count() / 1e6,
+                    Percentile(latencies, 0.5) * 1e3, Percentile(latencies, 0.9) * 1e3,
+                    Percentile(latencies, 0.99) * 1e3, latencies.back() * 1e3);
+    }
+    std::printf("\n");
+
+    return failed ? 1 : 0;
+}